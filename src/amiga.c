@@ -31,41 +31,154 @@
 #include "config.h"
 #include "mfm.h"
 
+/*
+ * Биты 32-битного x раздвигаются на чётные позиции 64-битного
+ * слова: бит k переходит в бит 2k. Как у блиттера Amiga, всё
+ * делается масками и сдвигами сразу для всех битов.
+ */
+static inline uint64_t spread(uint64_t x)
+{
+    x = (x | x << 16) & 0x0000ffff0000ffffULL;
+    x = (x | x << 8)  & 0x00ff00ff00ff00ffULL;
+    x = (x | x << 4)  & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | x << 2)  & 0x3333333333333333ULL;
+    x = (x | x << 1)  & 0x5555555555555555ULL;
+    return x;
+}
+
+/*
+ * Обратно: чётные биты x собираются в 32-битное слово.
+ */
+static inline uint64_t compact(uint64_t x)
+{
+    x &= 0x5555555555555555ULL;
+    x = (x | x >> 1)  & 0x3333333333333333ULL;
+    x = (x | x >> 2)  & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | x >> 4)  & 0x00ff00ff00ff00ffULL;
+    x = (x | x >> 8)  & 0x0000ffff0000ffffULL;
+    x = (x | x >> 16) & 0x00000000ffffffffULL;
+    return x;
+}
+
+static inline uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void put_be32(unsigned char *p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+static inline uint64_t get_be64(const unsigned char *p)
+{
+    return (uint64_t) get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static inline void put_be64(unsigned char *p, uint64_t x)
+{
+    put_be32(p, x >> 32);
+    put_be32(p + 4, x);
+}
+
 /*
  * Первый аргумент содержит нечётные биты 32-битного слова,
- * второй - чётные биты. Возвращаем значение исходного слова.
+ * второй - чётные. Возвращаем значение исходного слова.
  */
-static unsigned long unshuffle(int odd, int even)
+unsigned long mfm_amiga_unshuffle(int odd, int even)
 {
-    unsigned long word;
+    return spread(odd & 0xffff) << 1 | spread(even & 0xffff);
+}
+
+/*
+ * Разбиваем слово на нечётные и чётные биты.
+ */
+void mfm_amiga_shuffle(unsigned long word, int *odd, int *even)
+{
+    *odd = compact(word >> 1);
+    *even = compact(word);
+}
+
+/*
+ * Контрольная сумма Amiga: XOR всех 16-битных слов блока.
+ * Складываем по 64 бита, затем сворачиваем до 16.
+ * Порядок байтов в памяти не важен: после свёртки байт
+ * с меньшим адресом остаётся первым.
+ */
+static unsigned checksum(const unsigned char *raw, int nbytes)
+{
+    uint64_t sum = 0, word;
+    uint16_t half;
+    unsigned char b [2];
     int i;
 
-    word = 0;
-    for (i=0; i<16; ++i) {
-        word <<= 2;
-        word |= (even >> 15 & 1) | (odd >> 14 & 2);
-        odd <<= 1;
-        even <<= 1;
+    for (i=0; i<nbytes; i+=8) {
+        memcpy(&word, raw + i, 8);
+        sum ^= word;
     }
-    return word;
+    sum ^= sum >> 32;
+    sum ^= sum >> 16;
+    half = sum;
+    memcpy(b, &half, 2);
+    return b[0] << 8 | b[1];
 }
 
 /*
- * Разбиваем слово на нечётные и чётные биты.
+ * Восстановление 512-байтного блока: в первой половине raw
+ * нечётные биты, во второй - чётные. За шаг собираются
+ * два 32-битных слова. Возвращаем контрольную сумму.
  */
-static void shuffle(unsigned long word, int *odd, int *even)
+unsigned mfm_amiga_unshuffle_block(unsigned char *data, const unsigned char *raw)
 {
     int i;
 
-    *odd = 0;
-    *even = 0;
-    for (i=0; i<16; i++) {
-        *odd <<= 1;
-        *even <<= 1;
-        *odd |= (word >> 31) & 1;
-        *even |= (word >> 30) & 1;
-        word <<= 2;
+    for (i=0; i<SECTSZ/2; i+=4)
+        put_be64(data + 2*i, spread(get_be32(raw + i)) << 1 |
+            spread(get_be32(raw + SECTSZ/2 + i)));
+    return checksum(raw, SECTSZ);
+}
+
+/*
+ * Разбиение 512-байтного блока на нечётные и чётные биты.
+ * Возвращаем контрольную сумму.
+ */
+unsigned mfm_amiga_shuffle_block(unsigned char *raw, const unsigned char *data)
+{
+    uint64_t word;
+    int i;
+
+    for (i=0; i<SECTSZ/2; i+=4) {
+        word = get_be64(data + 2*i);
+        put_be32(raw + i, compact(word >> 1));
+        put_be32(raw + SECTSZ/2 + i, compact(word));
     }
+    return checksum(raw, SECTSZ);
+}
+
+/*
+ * Проверяем, что найденное на данном полубите синхрослово
+ * входит в маркер Amiga: 00-a1-a1-fx, где a1 записаны
+ * с нарушением кодирования.  Байты маркера сравниваем
+ * декодированными.  Маркер начинается не раньше from,
+ * нулевой байт перед ним может лежать и до from (до начала
+ * дорожки считаем нули).  Возвращаем тег, а начало первого
+ * a1 - через mark, или -1.
+ */
+static int amiga_marker(mfm_reader_t *reader, int halfbit, int from, int *mark)
+{
+    int tag;
+
+    *mark = mfm_sync_mark(reader->data, reader->nhalfbits, halfbit, from - 16, 2);
+    if (*mark < 0 || *mark + 48 > reader->nhalfbits)
+        return -1;
+
+    tag = mfm_decode_word(mfm_raw16(reader->data, reader->nhalfbits, *mark + 32));
+    if ((tag & 0xf0) != 0xf0)
+        return -1;
+    return tag;
 }
 
 /*
@@ -73,75 +186,61 @@ static void shuffle(unsigned long word, int *odd, int *even)
  */
 int mfm_scan_amiga(mfm_reader_t *reader, int *nbits_read)
 {
-    int bit, tag;
-    unsigned long history;
-
-    history = 0;
-    if (nbits_read)
-        *nbits_read = 0;
-    for (;;) {
-        bit = mfm_read_bit(reader);
-        if (bit < 0) {
-            if (mfm_verbose && nbits_read)
-                fprintf(mfm_err, "Track %d/%d: final gap %d bits\n",
-                    reader->track >> 1, reader->track & 1, *nbits_read);
-            return -1;
-        }
-        history = history << 1 | bit;
-        if (nbits_read)
-            ++*nbits_read;
-
-        if ((history & 0xffffffff) == 0xffffffff) {
-            /* Все единицы - подсинхронизовываемся на полубит. */
-            mfm_read_halfbit(reader);
-            history = 0;
+    int start, halfbit, sync, tag, mark;
+
+    start = reader->halfbit;
+    for (halfbit = start; ; ++halfbit) {
+        halfbit = mfm_sync_search(reader->data, reader->nhalfbits,
+            halfbit, &sync);
+        if (halfbit < 0)
+            break;
+        if (sync != MFM_SYNC_A1)
             continue;
-        }
 
-        /* Формат Amiga: ждем 00-a1-a1-fx. */
-        if ((history & 0xfffffff0) == 0x00a1a1f0) {
-            /* Нашли маркер, читаем и возвращаем его тег. */
-            tag = history & 0xff;
+        tag = amiga_marker(reader, halfbit, start, &mark);
+        if (tag >= 0) {
+            /* Нашли маркер, возвращаем его тег. */
+            mfm_stat_add(MFM_STAT_MARKS, 1);
+            MFM_TRACE(MFM_EV_MARK, reader->track, mark, tag);
+            reader->halfbit = mark + 48;
+            if (nbits_read)
+                *nbits_read = (reader->halfbit - start) / 2;
             return tag;
         }
     }
+    reader->halfbit = reader->nhalfbits;
+    if (nbits_read) {
+        *nbits_read = (reader->halfbit - start) / 2;
+        if (mfm_verbose)
+            fprintf(mfm_err, "Track %d/%d: final gap %d bits\n",
+                reader->track >> 1, reader->track & 1, *nbits_read);
+    }
+    return -1;
 }
 
 /*
  * Определяем тип дискеты.
  * Возвращаем 0 для IBM PC или 1 для Amiga.
  */
-int mfm_detect_amiga(FILE *fin)
+int mfm_detect_amiga(mfm_image_t *img)
 {
     mfm_reader_t reader;
-    unsigned long history;
-    int bit;
+    int halfbit, sync, mark;
 
-    mfm_read_seek(&reader, fin, 0);
-    history = 0x13713713;
-    for (;;) {
-        bit = mfm_read_bit(&reader);
-        if (bit < 0)
+    mfm_read_seek(&reader, img, 0);
+    for (halfbit = 0; ; ++halfbit) {
+        halfbit = mfm_sync_search(reader.data, reader.nhalfbits,
+            halfbit, &sync);
+        if (halfbit < 0)
             return -1;
-        history = history << 1 | bit;
-        history &= 0xffffffff;
-
-        /* Все единицы - подсинхронизовываемся на полубит. */
-        if (history == 0xffffffff) {
-            mfm_read_halfbit(&reader);
-            history = 0;
-            continue;
-        }
 
         /* Формат IBM PC: ждем 00-a1-a1-a1 или 00-c2-c2-c2. */
-        if (history == 0x00a1a1a1 || history == 0x00c2c2c2) {
+        if (mfm_sync_mark(reader.data, reader.nhalfbits, halfbit, 0, 3) >= 0)
             return 0;
-        }
 
         /* Формат Amiga: ждем 00-a1-a1-fx. */
-        if ((history & ~0xf) == 0x00a1a1f0) {
+        if (sync == MFM_SYNC_A1 && amiga_marker(&reader, halfbit, 0, &mark) >= 0)
             return 1;
-        }
     }
 }
 
@@ -158,7 +257,7 @@ static unsigned long read_long(mfm_reader_t *reader, unsigned long *sum)
     even = mfm_read_byte(reader) << 8;
     even |= mfm_read_byte(reader);
     *sum ^= odd ^ even;
-    return unshuffle(odd, even);
+    return mfm_amiga_unshuffle(odd, even);
 }
 
 /*
@@ -167,37 +266,17 @@ static unsigned long read_long(mfm_reader_t *reader, unsigned long *sum)
  */
 static int read_data(mfm_reader_t *reader, unsigned char *data)
 {
-    unsigned long ldata;
-    int odd [128], even [128], sum, i;
+    unsigned char raw [SECTSZ];
 
-    /* Первая половина - нечётные биты. */
-    for (i=0; i<SECTSZ/4; ++i) {
-        odd[i] = mfm_read_byte(reader) << 8;
-        odd[i] |= mfm_read_byte(reader);
-    }
-    /* Вторая половина - чётные биты. */
-    for (i=0; i<SECTSZ/4; ++i) {
-        even[i] = mfm_read_byte(reader) << 8;
-        even[i] |= mfm_read_byte(reader);
-    }
-    /* Восстанавливаем данные. */
-    sum = 0;
-    for (i=0; i<SECTSZ/4; ++i) {
-        ldata = unshuffle(odd[i], even[i]);
-        sum ^= odd[i] ^ even[i];
-        *data++ = ldata >> 24;
-        *data++ = ldata >> 16;
-        *data++ = ldata >> 8;
-        *data++ = ldata;
-    }
-    return sum;
+    mfm_read_bytes(reader, raw, SECTSZ);
+    return mfm_amiga_unshuffle_block(data, raw);
 }
 
 /*
  * Чтение очередного сектора с дискеты формата Amiga.
  */
 int mfm_read_sector_amiga(mfm_reader_t *reader, unsigned char *data,
-    int *sector_gap)
+    int *bad_crc, int *sector_gap)
 {
     int tag, track, sector, odd, even, gap;
     unsigned long label[4], header_sum, data_sum;
@@ -214,7 +293,7 @@ int mfm_read_sector_amiga(mfm_reader_t *reader, unsigned char *data,
         odd = (tag << 8) | mfm_read_byte(reader);
         even = mfm_read_byte(reader) << 8;
         even |= mfm_read_byte(reader);
-        tag = unshuffle(odd, even) & 0xffffff;
+        tag = mfm_amiga_unshuffle(odd, even) & 0xffffff;
         track = tag >> 16;
         sector = tag >> 8 & 0xff;
         my_header_sum = odd ^ even;
@@ -233,6 +312,7 @@ int mfm_read_sector_amiga(mfm_reader_t *reader, unsigned char *data,
         header_sum |= mfm_read_byte(reader) << 8;
         header_sum |= mfm_read_byte(reader);
         if (my_header_sum != header_sum) {
+            mfm_stat_add(MFM_STAT_HEADER_CRC, 1);
             fprintf(mfm_err, "track %d sector %d: header sum %08lx, expected %08lx\n",
                 track, sector, my_header_sum, header_sum);
             return -1;
@@ -248,111 +328,161 @@ int mfm_read_sector_amiga(mfm_reader_t *reader, unsigned char *data,
         data_sum |= mfm_read_byte(reader);
 
         my_data_sum = read_data(reader, data);
-        if (my_data_sum != data_sum)
+        if (my_data_sum != data_sum) {
+            mfm_stat_add(MFM_STAT_DATA_CRC, 1);
             fprintf(mfm_err, "track %d sector %d: data sum %08lx, expected %08lx\n",
                 track, sector, my_data_sum, data_sum);
+        }
+        if (bad_crc)
+            *bad_crc = (my_data_sum != data_sum);
+        MFM_TRACE(MFM_EV_SECTOR, reader->track, sector, my_data_sum != data_sum);
         return sector;
     }
 }
 
 /*
- * Читаем дискету Amiga из MFM-файла. Количество дорожек (до 160)
- * задаётся параметром ntracks.
+ * Чтение секторов одной дорожки Amiga в буфер дорожки.
  */
-void mfm_read_amiga(mfm_disk_t *d, FILE *fin, int ntracks)
+static void read_sectors_amiga(mfm_reader_t *reader, mfm_track_data_t *td)
 {
-    int t, s;
-    mfm_reader_t reader;
-    unsigned char block [SECTSZ];
-    int have_sector [MAXSECT];
+    int t = reader->track, s, bad_crc;
+    unsigned char data [SECTSZ];
 
-    d->ntracks = ntracks;
-    d->nsectors_per_track = 11;
-    for (t=0; t<d->ntracks; ++t) {
-        mfm_read_seek(&reader, fin, t);
-        for (s=0; s<MAXSECT; ++s)
-            have_sector [s] = 0;
-        for (;;) {
-            s = mfm_read_sector_amiga(&reader, block, 0);
-            if (s < 0)
-                break;
-            if (s >= d->nsectors_per_track) {
-                fprintf(mfm_err, "track %d: too large sector number %d\n",
-                    t, s);
-                continue;
-            }
-            /* Сектора могут следовать в произвольном порядке. */
-            have_sector [s] = 1;
-            memcpy(d->block[t][s], block, SECTSZ);
+    mfm_track_clear(td, t);
+    for (;;) {
+        s = mfm_read_sector_amiga(reader, data, &bad_crc, 0);
+        if (s < 0)
+            break;
+        if (s >= 11) {
+            fprintf(mfm_err, "track %d: too large sector number %d\n",
+                t, s);
+            continue;
         }
+        /* Сектора могут следовать в произвольном порядке. */
+        memcpy(mfm_track_add(td, s, 2, bad_crc), data, SECTSZ);
+    }
 
-        /* Проверим, что получили все сектора. */
-        for (s=0; s<d->nsectors_per_track; ++s) {
-            if (! have_sector [s])
-                fprintf(mfm_err, "track %d: no sector %d\n", t, s);
+    /* Проверим, что получили все сектора. */
+    for (s=0; s<11; ++s) {
+        if (! (td->info.present >> s & 1)) {
+            mfm_stat_add(MFM_STAT_MISSING, 1);
+            fprintf(mfm_err, "track %d: no sector %d\n", t, s);
         }
     }
 }
 
 /*
- * Исследуем и печатаем информацию о дискете Amiga из MFM-файла.
- * Количество дорожек (до 160) задаётся параметром ntracks.
+ * Чтение одной дорожки Amiga в образ диска.
  */
-void mfm_analyze_amiga(FILE *fin, int ntracks)
+static int read_track_amiga(mfm_reader_t *reader, void *arg)
 {
-    int t, s, i, nsectors_per_track;
-    mfm_reader_t reader;
+    mfm_disk_t *d = arg;
+    mfm_track_data_t td;
+
+    read_sectors_amiga(reader, &td);
+    mfm_disk_put_track(d, reader->track, &td);
+    return 0;
+}
+
+/*
+ * Читаем дискету Amiga из MFM-файла. Количество дорожек (до 160)
+ * задаётся параметром ntracks.
+ */
+mfm_disk_t *mfm_read_amiga(mfm_image_t *img, int ntracks)
+{
+    mfm_disk_t *d;
+
+    d = mfm_disk_alloc(ntracks, 11, 2);
+    mfm_for_each_track(img, 0, ntracks, read_track_amiga, d);
+    return d;
+}
+
+/*
+ * Декодирование дорожки Amiga в потоке.
+ */
+static void stream_track_amiga(mfm_stream_slot_t *slot, void *arg)
+{
+    read_sectors_amiga(&slot->reader, &slot->td);
+    slot->nsectors_per_track = 11;
+    slot->size = 2;
+}
+
+/*
+ * Извлекаем дискету Amiga из MFM-образа, выдавая сектора каждой
+ * дорожки сразу после её декодирования.
+ */
+void mfm_stream_amiga(mfm_image_t *img, int ntracks, FILE *fout)
+{
+    mfm_stream_tracks(img, ntracks, fout, stream_track_amiga, 0);
+}
+
+/*
+ * Исследуем и печатаем информацию об одной дорожке Amiga.
+ */
+static int analyze_track_amiga(mfm_reader_t *reader, void *arg)
+{
+    int t = reader->track, s, i, nsectors_per_track;
     unsigned char block [SECTSZ];
     int have_sector [MAXSECT];
     int order_of_sectors [MAXSECT];
     int sector_gap [MAXSECT];
 
-    fprintf(mfm_err, "Format: Amiga\n");
-    for (t=0; t<ntracks; ++t) {
-        fprintf(mfm_err, "\n");
-        mfm_read_seek(&reader, fin, t);
-        for (s=0; s<MAXSECT; ++s)
-            have_sector [s] = 0;
-        nsectors_per_track = 0;
-        for (i=0; ; ++i) {
-            s = mfm_read_sector_amiga(&reader, block, &sector_gap[i]);
-            if (s < 0)
-                break;
-            if (s >= MAXSECT) {
-                fprintf(mfm_err, "Too many sectors per track = %d, aborted.\n",
-                    s+1);
-                exit(-1);
-            }
-            if (s >= nsectors_per_track)
-                nsectors_per_track = s + 1;
-
-            /* Сектора могут следовать в произвольном порядке. */
-            have_sector [s] = 1;
-            order_of_sectors [i] = s;
+    fprintf(mfm_err, "\n");
+    for (s=0; s<MAXSECT; ++s)
+        have_sector [s] = 0;
+    nsectors_per_track = 0;
+    for (i=0; ; ++i) {
+        s = mfm_read_sector_amiga(reader, block, 0, &sector_gap[i]);
+        if (s < 0)
+            break;
+        if (s >= MAXSECT) {
+            fprintf(mfm_err, "Too many sectors per track = %d, aborted.\n",
+                s+1);
+            return -1;
         }
-        fprintf(mfm_err, "Track %d/%d: %d sectors per track\n",
-            t >> 1, t & 1, nsectors_per_track);
-        if (nsectors_per_track < 1)
-            continue;
+        if (s >= nsectors_per_track)
+            nsectors_per_track = s + 1;
 
-        fprintf(mfm_err, "Order of sectors:");
-        for (s=0; s<i; ++s) {
-            fprintf(mfm_err, " %d", order_of_sectors[s] + 1);
-        }
-        fprintf(mfm_err, "\n");
+        /* Сектора могут следовать в произвольном порядке. */
+        have_sector [s] = 1;
+        order_of_sectors [i] = s;
+    }
+    fprintf(mfm_err, "Track %d/%d: %d sectors per track\n",
+        t >> 1, t & 1, nsectors_per_track);
+    if (nsectors_per_track < 1)
+        return 0;
+
+    fprintf(mfm_err, "Order of sectors:");
+    for (s=0; s<i; ++s) {
+        fprintf(mfm_err, " %d", order_of_sectors[s] + 1);
+    }
+    fprintf(mfm_err, "\n");
 
-        fprintf(mfm_err, "Sector gap:");
-        for (s=0; s<i; ++s) {
-            fprintf(mfm_err, " %d", sector_gap[s] - 5*8);
-        }
-        fprintf(mfm_err, " bits (std %d)\n", 0);
+    fprintf(mfm_err, "Sector gap:");
+    for (s=0; s<i; ++s) {
+        fprintf(mfm_err, " %d", sector_gap[s] - 5*8);
+    }
+    fprintf(mfm_err, " bits (std %d)\n", 0);
 
-        /* Проверим, что получили все сектора. */
-        for (s=0; s<nsectors_per_track; ++s) {
-            if (! have_sector [s])
-                fprintf(mfm_err, "No sector %d\n", s + 1);
+    /* Проверим, что получили все сектора. */
+    for (s=0; s<nsectors_per_track; ++s) {
+        if (! have_sector [s]) {
+            mfm_stat_add(MFM_STAT_MISSING, 1);
+            fprintf(mfm_err, "No sector %d\n", s + 1);
         }
     }
+    return 0;
+}
+
+/*
+ * Исследуем и печатаем информацию о дискете Amiga из MFM-файла.
+ * Количество дорожек (до 160) задаётся параметром ntracks.
+ */
+void mfm_analyze_amiga(mfm_image_t *img, int ntracks)
+{
+    fprintf(mfm_err, "Format: Amiga\n");
+    if (mfm_for_each_track(img, 0, ntracks, analyze_track_amiga, 0) < 0)
+        exit(-1);
 }
 
 /*
@@ -381,11 +511,12 @@ static void write_marker(mfm_writer_t *writer)
 }
 
 /*
- * Записываем идентификатор и его контрольную сумму.
+ * Поле идентификатора: слово дорожки и сектора с перестановкой
+ * битов, пустая метка и контрольная сумма.
  */
-static void write_ident(mfm_writer_t *writer, int t, int s)
+static void ident_field(unsigned char *field, int t, int s)
 {
-    int sum, i, odd, even;
+    int sum, odd, even;
     unsigned long ldata;
 
     /* Compute identifier and checksum. */
@@ -393,62 +524,93 @@ static void write_ident(mfm_writer_t *writer, int t, int s)
     ldata |= t << 16;
     ldata |= s << 8;
     ldata |= 11-s;
-    shuffle(ldata, &odd, &even);
+    mfm_amiga_shuffle(ldata, &odd, &even);
     sum = odd ^ even;
 
-    /* Write identifier. */
-    mfm_write_byte(writer, odd >> 8);
-    mfm_write_byte(writer, odd);
-    mfm_write_byte(writer, even >> 8);
-    mfm_write_byte(writer, even);
+    /* Identifier, empty label, checksum. */
+    field[0] = odd >> 8;
+    field[1] = odd;
+    field[2] = even >> 8;
+    field[3] = even;
+    memset(field + 4, 0, 16);
+    field[20] = sum >> 24;
+    field[21] = sum >> 16;
+    field[22] = sum >> 8;
+    field[23] = sum;
+}
 
-    /* Write label. */
-    for (i=0; i<16; ++i) {
-        mfm_write_byte(writer, 0);
-    }
+/*
+ * Поле данных: 4 байта контрольной суммы и 512-байтный
+ * блок с перестановкой битов, сначала нечётные биты.
+ */
+static void data_field(unsigned char *field, const unsigned char *data)
+{
+    int sum;
 
-    /* Write checksum. */
-    mfm_write_byte(writer, sum >> 24);
-    mfm_write_byte(writer, sum >> 16);
-    mfm_write_byte(writer, sum >> 8);
-    mfm_write_byte(writer, sum);
+    sum = mfm_amiga_shuffle_block(field + 4, data);
+    field[0] = sum >> 24;
+    field[1] = sum >> 16;
+    field[2] = sum >> 8;
+    field[3] = sum;
 }
 
+typedef struct {
+    mfm_disk_t *disk;
+    mfm_template_t *tpl;        /* шаблон дорожки, или 0 */
+    mfm_template_t *build;      /* строящийся шаблон, или 0 */
+} write_args_t;
+
 /*
- * Запись 512-байтного блока с перестановкой битов.
- * Перед блоком записывается 4 байта контрольной суммы.
+ * Записываем одну дорожку в формате Amiga.
+ * При построении шаблона данные секторов нулевые,
+ * а начало каждого поля отмечается в шаблоне.
  */
-static void write_sector(mfm_writer_t *writer, unsigned char *data)
+static void encode_track_amiga(mfm_writer_t *writer, int t, write_args_t *args)
 {
-    unsigned long ldata;
-    int odd [128], even [128], sum, i;
-
-    /* Shuffle data, compute checksum. */
-    sum = 0;
-    for (i=0; i<SECTSZ/4; ++i) {
-        ldata = data[4*i] << 24;
-        ldata |= data[4*i+1] << 16;
-        ldata |= data[4*i+2] << 8;
-        ldata |= data[4*i+3];
-        shuffle(ldata, &odd[i], &even[i]);
-        sum ^= odd[i] ^ even[i];
+    static const unsigned char zero [SECTSZ];
+    unsigned char field [4 + SECTSZ];
+    mfm_disk_t *d = args->disk;
+    int s;
+
+    mfm_write_gap(writer, 150, 0);
+    for (s=0; s<d->nsectors_per_track; ++s) {
+        write_marker(writer);
+        mfm_template_field(args->build, writer, 24);
+        ident_field(field, t, s);
+        mfm_write(writer, field, 24);
+        mfm_template_field(args->build, writer, 4 + SECTSZ);
+        data_field(field, args->build ? zero : mfm_disk_sector(d, t, s));
+        mfm_write(writer, field, 4 + SECTSZ);
     }
+    mfm_fill_track(writer, 0);
+}
 
-    /* Write checksum. */
-    mfm_write_byte(writer, sum >> 24);
-    mfm_write_byte(writer, sum >> 16);
-    mfm_write_byte(writer, sum >> 8);
-    mfm_write_byte(writer, sum);
-
-    /* Write data, odd bits first. */
-    for (i=0; i<SECTSZ/4; ++i) {
-        mfm_write_byte(writer, odd[i] >> 8);
-        mfm_write_byte(writer, odd[i]);
+/*
+ * Дорожка по шаблону: кодируются только поля идентификаторов
+ * и ненулевые сектора.
+ */
+static void write_track_amiga(mfm_writer_t *writer, int t, void *arg)
+{
+    write_args_t *args = arg;
+    unsigned char field [4 + SECTSZ];
+    const unsigned char *data;
+    int s;
+
+    if (! args->tpl) {
+        encode_track_amiga(writer, t, args);
+        return;
     }
-    for (i=0; i<SECTSZ/4; ++i) {
-        mfm_write_byte(writer, even[i] >> 8);
-        mfm_write_byte(writer, even[i]);
+    mfm_template_begin(writer, args->tpl);
+    for (s=0; s<args->disk->nsectors_per_track; ++s) {
+        ident_field(field, t, s);
+        mfm_template_splice(writer, args->tpl, 2*s, field);
+        data = mfm_disk_sector(args->disk, t, s);
+        if (mfm_is_zero(data, SECTSZ))
+            continue;
+        data_field(field, data);
+        mfm_template_splice(writer, args->tpl, 2*s + 1, field);
     }
+    mfm_template_end(writer);
 }
 
 /*
@@ -457,21 +619,28 @@ static void write_sector(mfm_writer_t *writer, unsigned char *data)
 void mfm_write_amiga(mfm_disk_t *d, FILE *fout)
 {
     mfm_writer_t writer;
-    int t, s;
+    write_args_t args;
+    int key [MFM_TEMPLATE_KEY];
 
     if (mfm_verbose)
         fprintf(mfm_err, "Creating %d tracks, %d sectors per track\n",
             d->ntracks, d->nsectors_per_track);
 
-    for (t=0; t<d->ntracks; ++t) {
-        mfm_write_reset(&writer, fout);
-        mfm_write_gap(&writer, 150, 0);
-
-        for (s=0; s<d->nsectors_per_track; ++s) {
-            write_marker(&writer);
-            write_ident(&writer, t, s);
-            write_sector(&writer, d->block[t][s]);
-        }
-        mfm_fill_track(&writer, 0);
+    args.disk = d;
+    args.build = 0;
+    args.tpl = 0;
+    memset(key, 0, sizeof(key));
+    key[0] = 2;                 /* Amiga */
+    key[1] = d->nsectors_per_track;
+    args.tpl = mfm_template_find(key);
+    if (! args.tpl) {
+        args.build = mfm_template_new(key);
+        mfm_write_reset(&writer, 0);
+        encode_track_amiga(&writer, 0, &args);
+        args.tpl = mfm_template_done(args.build, &writer);
+        args.build = 0;
     }
+    if (! args.tpl->valid)
+        args.tpl = 0;
+    mfm_write_disk(fout, d, write_track_amiga, &args);
 }
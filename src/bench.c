@@ -0,0 +1,410 @@
+/*
+ * End-to-end benchmarks of mfmdisk on a synthetic corpus.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "config.h"
+
+#define TRACKSZ     12800       /* bytes per track in MFM image */
+#define NTRACKS     160
+#define SECTSZ      512
+#define SCP_TICKS   80          /* 25-ns ticks per halfbit at 250 kbit/s */
+
+static const char *mfmdisk;     /* program under test */
+static const char *corpus = "bench-corpus";
+static int nruns = 5;
+static int jitter = 5;          /* SCP flux jitter, percent of a halfbit */
+static char *jobs;              /* -j option passed to mfmdisk */
+
+static void usage()
+{
+    fprintf(stderr, "End-to-end benchmarks of mfmdisk, version %s\n", PACKAGE_VERSION);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "    mfmbench [options] path/to/mfmdisk\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -n N       run each benchmark N times, default %d\n", nruns);
+    fprintf(stderr, "    -d DIR     directory for the corpus, default %s\n", corpus);
+    fprintf(stderr, "    -J PCT     jitter of SCP flux in percent, default %d\n", jitter);
+    fprintf(stderr, "    -j N       pass -j N to mfmdisk\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Results are printed as one JSON object per line.\n");
+    exit(-1);
+}
+
+/*
+ * Deterministic pseudo-random numbers: xorshift64*.
+ */
+static uint64_t rnd_state;
+
+static void rnd_seed(const char *name)
+{
+    rnd_state = 0x9e3779b97f4a7c15ULL;
+    while (*name)
+        rnd_state = (rnd_state ^ (unsigned char) *name++) * 0x100000001b3ULL;
+}
+
+static uint32_t rnd()
+{
+    rnd_state ^= rnd_state >> 12;
+    rnd_state ^= rnd_state << 25;
+    rnd_state ^= rnd_state >> 27;
+    return (rnd_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static char *path(const char *name)
+{
+    static char buf [4] [512];
+    static int i;
+
+    i = (i + 1) % 4;
+    snprintf(buf[i], sizeof(buf[i]), "%s/%s", corpus, name);
+    return buf[i];
+}
+
+static void write_file(const char *name, const void *data, size_t nbytes)
+{
+    FILE *f = fopen(path(name), "wb");
+
+    if (! f || fwrite(data, 1, nbytes, f) != nbytes || fclose(f) != 0) {
+        perror(path(name));
+        exit(-1);
+    }
+}
+
+static unsigned char *read_file(const char *name, size_t *nbytes)
+{
+    FILE *f = fopen(path(name), "rb");
+    unsigned char *data;
+    struct stat st;
+
+    if (! f || fstat(fileno(f), &st) < 0) {
+        perror(path(name));
+        exit(-1);
+    }
+    data = malloc(st.st_size + 1);
+    if (! data || fread(data, 1, st.st_size, f) != (size_t) st.st_size) {
+        perror(path(name));
+        exit(-1);
+    }
+    fclose(f);
+    *nbytes = st.st_size;
+    return data;
+}
+
+static long file_size(const char *name)
+{
+    struct stat st;
+
+    if (stat(path(name), &st) < 0)
+        return 0;
+    return st.st_size;
+}
+
+/*
+ * Binary floppy image: random sectors mixed with
+ * zero-filled and repeated-pattern ones, like a real disk.
+ */
+static void make_raw(const char *name, int nsectors_per_track)
+{
+    size_t nbytes = (size_t) NTRACKS * nsectors_per_track * SECTSZ;
+    unsigned char *data = malloc(nbytes);
+    size_t i, j;
+
+    rnd_seed(name);
+    for (i=0; i<nbytes; i+=SECTSZ) {
+        switch (rnd() % 4) {
+        case 0:
+            memset(data + i, 0, SECTSZ);
+            break;
+        case 1:
+            memset(data + i, 0xe5, SECTSZ);
+            break;
+        default:
+            for (j=0; j<SECTSZ; ++j)
+                data[i + j] = rnd();
+            break;
+        }
+    }
+    write_file(name, data, nbytes);
+    free(data);
+}
+
+static void put32(unsigned char *p, uint32_t val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
+/*
+ * SCP flux image from an MFM image: one revolution per track,
+ * a flux transition at every 1 halfbit.  Each interval is
+ * disturbed by up to +/- jitter percent of a halfbit.
+ */
+static void make_scp(const char *name, const char *mfm_name)
+{
+    size_t nbytes, size, hdr_size = 0x10 + 4*168;
+    unsigned char *mfm, *scp, *p, *trk;
+    int ntracks, t, i, nflux, cnt, val, spread;
+
+    mfm = read_file(mfm_name, &nbytes);
+    ntracks = nbytes / TRACKSZ;
+
+    /* At most one sample per halfbit. */
+    size = hdr_size + (size_t) ntracks * (16 + TRACKSZ * 8 * 2);
+    scp = calloc(1, size);
+    memcpy(scp, "SCP", 3);
+    scp[3] = 0x19;                  /* version */
+    scp[4] = 6;                     /* disk type */
+    scp[5] = 1;                     /* revolutions */
+    scp[6] = 0;                     /* start track */
+    scp[7] = ntracks;               /* end track */
+    scp[8] = 1;                     /* flags: index */
+
+    rnd_seed(name);
+    spread = SCP_TICKS * jitter / 100;
+    p = scp + hdr_size;
+    for (t=0; t<ntracks; ++t) {
+        put32(scp + 0x10 + 4*t, p - scp);
+        trk = p;
+        memcpy(p, "TRK", 3);
+        p[3] = t;
+        p += 16;
+        nflux = 0;
+        cnt = 0;
+        for (i=0; i<TRACKSZ*8; ++i) {
+            cnt++;
+            if (mfm[t*TRACKSZ + i/8] >> (7 - i%8) & 1) {
+                val = cnt * SCP_TICKS;
+                if (spread)
+                    val += (int) (rnd() % (2*spread + 1)) - spread;
+                p[0] = val >> 8;
+                p[1] = val;
+                p += 2;
+                nflux++;
+                cnt = 0;
+            }
+        }
+        put32(trk + 4, TRACKSZ * 8 * SCP_TICKS);
+        put32(trk + 8, nflux);
+        put32(trk + 12, 16);
+    }
+    write_file(name, scp, p - scp);
+    free(scp);
+    free(mfm);
+}
+
+/*
+ * Run mfmdisk once with output discarded.
+ * Return wall time in seconds, or -1 on failure.
+ */
+static double run(char **argv, struct rusage *ru)
+{
+    struct timespec t0, t1;
+    int status, fd;
+    pid_t pid;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        fd = open("/dev/null", O_WRONLY);
+        if (fd >= 0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, ru) < 0) {
+        perror("wait4");
+        exit(-1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (! WIFEXITED(status) || WEXITSTATUS(status) == 127)
+        return -1;
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+
+    return (x > y) - (x < y);
+}
+
+static double seconds(struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec * 1e-6;
+}
+
+/*
+ * Run one benchmark nruns times and print its result.
+ * Arguments are separated by spaces; file names (words with
+ * an extension) are taken relative to the corpus.  Throughput is counted
+ * on the size of the input file.
+ */
+static void bench(const char *name, const char *args, const char *input, int ntracks)
+{
+    char *argv [16], *copy, *word;
+    double wall [64], user, sys, median;
+    long max_rss, nbytes;
+    struct rusage ru;
+    int argc, i, n;
+
+    argc = 0;
+    argv[argc++] = (char*) mfmdisk;
+    if (jobs) {
+        argv[argc++] = "-j";
+        argv[argc++] = jobs;
+    }
+    copy = strdup(args);
+    for (word = strtok(copy, " "); word && argc < 15; word = strtok(0, " "))
+        argv[argc++] = strchr(word, '.') ? strdup(path(word)) : word;
+    argv[argc] = 0;
+
+    fprintf(stderr, "%s: %s\n", name, args);
+    n = (nruns < 64) ? nruns : 64;
+    user = sys = 0;
+    max_rss = 0;
+    for (i=0; i<n; ++i) {
+        wall[i] = run(argv, &ru);
+        if (wall[i] < 0) {
+            printf("{\"bench\":\"%s\",\"args\":\"%s\",\"error\":\"failed\"}\n",
+                name, args);
+            fflush(stdout);
+            return;
+        }
+        user += seconds(&ru.ru_utime);
+        sys += seconds(&ru.ru_stime);
+        if (ru.ru_maxrss > max_rss)
+            max_rss = ru.ru_maxrss;
+    }
+    qsort(wall, n, sizeof(wall[0]), compare_double);
+    median = (n & 1) ? wall[n/2] : (wall[n/2 - 1] + wall[n/2]) / 2;
+    nbytes = file_size(input);
+
+    printf("{\"bench\":\"%s\",\"args\":\"%s\",\"version\":\"%s\",\"jobs\":%s,"
+        "\"runs\":%d,\"bytes\":%ld,\"tracks\":%d,"
+        "\"wall_min\":%.6f,\"wall_median\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+        "\"mb_per_s\":%.3f,\"tracks_per_s\":%.1f,\"max_rss_kb\":%ld}\n",
+        name, args, PACKAGE_VERSION, jobs ? jobs : "1",
+        n, nbytes, ntracks,
+        wall[0], median, user / n, sys / n,
+        (median > 0) ? nbytes / median / 1e6 : 0,
+        (median > 0) ? ntracks / median : 0, max_rss);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *formats[] = { "pc9", "pc10", "bk", "amiga", "scp" };
+    char name [64], args [256];
+    unsigned i;
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "n:d:J:j:h");
+        if (c < 0)
+            break;
+        switch (c) {
+        case 'n':
+            nruns = strtol(optarg, 0, 0);
+            break;
+        case 'd':
+            corpus = optarg;
+            break;
+        case 'J':
+            jitter = strtol(optarg, 0, 0);
+            break;
+        case 'j':
+            jobs = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || nruns < 1)
+        usage();
+    mfmdisk = argv[optind];
+    if (access(mfmdisk, X_OK) < 0) {
+        perror(mfmdisk);
+        exit(-1);
+    }
+
+    /* Corpus: binary images first, MFM images are made by mfmdisk. */
+    mkdir(corpus, 0777);
+    make_raw("pc9.img", 9);
+    make_raw("pc10.img", 10);
+    make_raw("amiga.img", 11);
+
+    bench("create-pc9", "-c pc9.mfm pc9.img", "pc9.img", NTRACKS);
+    bench("create-pc10", "-c -s 10 pc10.mfm pc10.img", "pc10.img", NTRACKS);
+    bench("create-bk", "-c -b bk.mfm pc10.img", "pc10.img", NTRACKS);
+    bench("create-amiga", "-c -a amiga.mfm amiga.img", "amiga.img", NTRACKS);
+
+    make_scp("pc9.scp", "pc9.mfm");
+    bench("create-scp", "-c scp.mfm pc9.scp", "pc9.scp", NTRACKS);
+
+    for (i=0; i<sizeof(formats)/sizeof(formats[0]); ++i) {
+        snprintf(name, sizeof(name), "%s.mfm", formats[i]);
+
+        snprintf(args, sizeof(args), "-i %s", name);
+        snprintf(name, sizeof(name), "info-%s", formats[i]);
+        bench(name, args, args + 3, 1);
+
+        snprintf(args, sizeof(args), "-i -v %s.mfm", formats[i]);
+        snprintf(name, sizeof(name), "info-verbose-%s", formats[i]);
+        bench(name, args, args + 6, NTRACKS);
+
+        snprintf(args, sizeof(args), "-x %s.mfm %s.out.img", formats[i], formats[i]);
+        snprintf(name, sizeof(name), "extract-%s", formats[i]);
+        snprintf(args + 128, 64, "%s.mfm", formats[i]);
+        bench(name, args, args + 128, NTRACKS);
+
+        snprintf(args, sizeof(args), "-d %s.mfm", formats[i]);
+        snprintf(name, sizeof(name), "dump-%s", formats[i]);
+        bench(name, args, args + 3, NTRACKS);
+    }
+    return 0;
+}
@@ -0,0 +1,343 @@
+/*
+ * CRC-CCITT engine with runtime kernel selection.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "config.h"
+#include "mfm.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define HAVE_X86_KERNELS 1
+#   include <immintrin.h>
+#endif
+
+#define CRC_POLY    0x1021      /* x^16 + x^12 + x^5 + 1 */
+
+/*
+ * All kernels update the sum with the given data, most significant
+ * bit first, without initial or final inversion: the caller starts
+ * with 0xffff, or with the sum of the sync marks, as before.
+ */
+typedef unsigned short crc_func_t(unsigned short sum,
+    const unsigned char *buf, unsigned len);
+
+/*
+ * Checksum lookup table.
+ * CRC-CCITT = x^16 + x^12 + x^5 + 1
+ */
+static const unsigned short poly_tab [256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+/*
+ * Slice tables: slice_tab[k][b] is the sum of byte b
+ * followed by k zero bytes.  Filled by mfm_crc_select().
+ */
+static unsigned short slice_tab [16] [256];
+
+/*
+ * Update the sum with one byte.
+ */
+unsigned short mfm_crc16_byte(unsigned short sum, unsigned char byte)
+{
+    return (sum << 8) ^ poly_tab [byte ^ (sum >> 8)];
+}
+
+/*
+ * Reference implementation: one byte per table lookup.
+ */
+static unsigned short crc_table(unsigned short sum,
+    const unsigned char *buf, unsigned len)
+{
+    while (len--) {
+        sum = (sum << 8) ^ poly_tab [*buf++ ^ (sum >> 8)];
+    }
+    return sum;
+}
+
+/*
+ * Slice-by-8: eight bytes per step, with independent lookups.
+ */
+static unsigned short crc_slice8(unsigned short sum,
+    const unsigned char *buf, unsigned len)
+{
+    for (; len >= 8; len -= 8) {
+        sum = slice_tab[7][buf[0] ^ (sum >> 8)] ^
+              slice_tab[6][buf[1] ^ (sum & 0xff)] ^
+              slice_tab[5][buf[2]] ^ slice_tab[4][buf[3]] ^
+              slice_tab[3][buf[4]] ^ slice_tab[2][buf[5]] ^
+              slice_tab[1][buf[6]] ^ slice_tab[0][buf[7]];
+        buf += 8;
+    }
+    return crc_table(sum, buf, len);
+}
+
+/*
+ * Slice-by-16.
+ */
+static unsigned short crc_slice16(unsigned short sum,
+    const unsigned char *buf, unsigned len)
+{
+    for (; len >= 16; len -= 16) {
+        sum = slice_tab[15][buf[0] ^ (sum >> 8)] ^
+              slice_tab[14][buf[1] ^ (sum & 0xff)] ^
+              slice_tab[13][buf[2]] ^ slice_tab[12][buf[3]] ^
+              slice_tab[11][buf[4]] ^ slice_tab[10][buf[5]] ^
+              slice_tab[9][buf[6]] ^ slice_tab[8][buf[7]] ^
+              slice_tab[7][buf[8]] ^ slice_tab[6][buf[9]] ^
+              slice_tab[5][buf[10]] ^ slice_tab[4][buf[11]] ^
+              slice_tab[3][buf[12]] ^ slice_tab[2][buf[13]] ^
+              slice_tab[1][buf[14]] ^ slice_tab[0][buf[15]];
+        buf += 16;
+    }
+    return crc_slice8(sum, buf, len);
+}
+
+/*
+ * Remainder of x^n modulo the CRC polynomial.
+ */
+static unsigned xpow_mod(int n)
+{
+    unsigned r = 1;
+
+    while (n-- > 0) {
+        r <<= 1;
+        if (r & 0x10000)
+            r ^= 0x10000 | CRC_POLY;
+    }
+    return r;
+}
+
+#ifdef HAVE_X86_KERNELS
+/*
+ * Carry-less multiplication: the message is folded 64 bytes
+ * at a time into four 128-bit accumulators, which stay congruent
+ * to the message modulo the polynomial.  The accumulators are
+ * then folded into one, and its 16 bytes are reduced with tables.
+ * Bit i of a 128-bit lane is the coefficient of x^i, so the bytes
+ * are loaded in reverse order.
+ */
+static __m128i fold_512, fold_128;     /* x^(512+64), x^512; x^(128+64), x^128 */
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i fold(__m128i acc, __m128i k, __m128i next)
+{
+    return _mm_xor_si128(next,
+        _mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x11),
+                      _mm_clmulepi64_si128(acc, k, 0x00)));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static unsigned short crc_pclmul(unsigned short sum,
+    const unsigned char *buf, unsigned len)
+{
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                         8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i a0, a1, a2, a3;
+    unsigned char block [16];
+
+    if (len < 64)
+        return crc_slice16(sum, buf, len);
+
+#define LOAD(p) _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p)), reverse)
+    /* The initial sum goes into the first two bytes. */
+    a0 = _mm_xor_si128(LOAD(buf), _mm_slli_si128(_mm_cvtsi32_si128(sum), 14));
+    a1 = LOAD(buf + 16);
+    a2 = LOAD(buf + 32);
+    a3 = LOAD(buf + 48);
+    buf += 64;
+    len -= 64;
+    for (; len >= 64; len -= 64) {
+        a0 = fold(a0, fold_512, LOAD(buf));
+        a1 = fold(a1, fold_512, LOAD(buf + 16));
+        a2 = fold(a2, fold_512, LOAD(buf + 32));
+        a3 = fold(a3, fold_512, LOAD(buf + 48));
+        buf += 64;
+    }
+    a1 = fold(a0, fold_128, a1);
+    a2 = fold(a1, fold_128, a2);
+    a3 = fold(a2, fold_128, a3);
+    for (; len >= 16; len -= 16) {
+        a3 = fold(a3, fold_128, LOAD(buf));
+        buf += 16;
+    }
+#undef LOAD
+
+    /* Reduce the 128-bit remainder, then the tail. */
+    _mm_storeu_si128((__m128i*) block, _mm_shuffle_epi8(a3, reverse));
+    sum = crc_slice16(0, block, 16);
+    return crc_slice8(sum, buf, len);
+}
+#endif
+
+static const struct {
+    const char *name;
+    crc_func_t *func;
+    const char *cpu;            /* required CPU feature, or 0 */
+} kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    { "pclmul",  crc_pclmul,   "pclmul" },
+#endif
+    { "slice16", crc_slice16,  0        },
+    { "slice8",  crc_slice8,   0        },
+    { "table",   crc_table,    0        },
+};
+
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static crc_func_t *crc_func;
+static const char *crc_name;
+
+/*
+ * Check whether the CPU supports the given feature.
+ */
+static int cpu_supports(const char *cpu)
+{
+    if (! cpu)
+        return 1;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (strcmp(cpu, "pclmul") == 0)
+        return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#endif
+    return 0;
+}
+
+/*
+ * Fill the slice tables and folding constants.
+ */
+static void crc_init()
+{
+    int k, b;
+
+    for (b=0; b<256; ++b) {
+        slice_tab[0][b] = poly_tab[b];
+        for (k=1; k<16; ++k)
+            slice_tab[k][b] = (slice_tab[k-1][b] << 8) ^
+                poly_tab [slice_tab[k-1][b] >> 8];
+    }
+#ifdef HAVE_X86_KERNELS
+    fold_512 = _mm_set_epi64x(xpow_mod(512 + 64), xpow_mod(512));
+    fold_128 = _mm_set_epi64x(xpow_mod(128 + 64), xpow_mod(128));
+#endif
+}
+
+/*
+ * Select the CRC kernel by name, or the best one
+ * supported by this CPU when name is 0.
+ * Return -1 when the requested kernel is not available.
+ */
+int mfm_crc_select(const char *name)
+{
+    unsigned i;
+
+    if (! crc_func)
+        crc_init();
+    for (i=0; i<NKERNELS; ++i) {
+        if (name && strcmp(name, kernels[i].name) != 0)
+            continue;
+        if (! cpu_supports(kernels[i].cpu))
+            continue;
+        crc_func = kernels[i].func;
+        crc_name = kernels[i].name;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Name of the currently selected kernel.
+ */
+const char *mfm_crc_kernel()
+{
+    if (! crc_func)
+        mfm_crc_select(0);
+    return crc_name;
+}
+
+/*
+ * Update the sum with len bytes of data.
+ * Use 0xffff as the initial sum value.
+ */
+unsigned short mfm_crc16_ccitt(unsigned short sum,
+    const unsigned char *buf, unsigned len)
+{
+    if (! crc_func)
+        mfm_crc_select(0);
+    return crc_func(sum, buf, len);
+}
+
+/*
+ * Update the sum with nbytes of data still in MFM form,
+ * starting at the given halfbit of raw track data.
+ */
+unsigned short mfm_crc16_mfm(unsigned short sum,
+    const unsigned char *raw, int halfbit, int nbytes)
+{
+    unsigned char chunk [512];
+    int n;
+
+    while (nbytes > 0) {
+        n = (nbytes < (int) sizeof(chunk)) ? nbytes : (int) sizeof(chunk);
+        mfm_decode(chunk, raw, halfbit, n);
+        sum = mfm_crc16_ccitt(sum, chunk, n);
+        halfbit += 16 * n;
+        nbytes -= n;
+    }
+    return sum;
+}
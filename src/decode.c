@@ -0,0 +1,272 @@
+/*
+ * Bulk decoding of MFM data fields.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "config.h"
+#include "mfm.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define HAVE_X86_KERNELS 1
+#   include <immintrin.h>
+#endif
+
+/*
+ * All kernels take raw MFM bytes and a starting halfbit offset,
+ * and produce nbytes of data.  They never read beyond the last raw byte
+ * covered by the field, so a field at the very end of a mapped image
+ * is safe to decode.
+ */
+typedef void decode_func_t(unsigned char *out, const unsigned char *raw,
+    int halfbit, int nbytes);
+
+/*
+ * Reference implementation: one data byte per table lookup.
+ */
+void mfm_decode_scalar(unsigned char *out, const unsigned char *raw,
+    int halfbit, int nbytes)
+{
+    const unsigned char *p;
+    unsigned word;
+    int shift = halfbit & 7;
+
+    p = raw + (halfbit >> 3);
+    while (nbytes-- > 0) {
+        word = p[0] << 16 | p[1] << 8;
+        if (shift)
+            word |= p[2];
+        *out++ = mfm_decode_word(word >> (8 - shift));
+        p += 2;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+/*
+ * Big-endian 64-bit load.
+ */
+static inline uint64_t load_be64(const unsigned char *p)
+{
+    uint64_t word;
+
+    memcpy(&word, p, 8);
+    return __builtin_bswap64(word);
+}
+
+/*
+ * BMI2: four data bytes per PEXT of 64 halfbits.
+ */
+__attribute__((target("bmi2")))
+static void decode_bmi2(unsigned char *out, const unsigned char *raw,
+    int halfbit, int nbytes)
+{
+    const unsigned char *p = raw + (halfbit >> 3);
+    int shift = halfbit & 7;
+    uint64_t word;
+    uint32_t data;
+
+    for (; nbytes >= 4; nbytes -= 4) {
+        word = load_be64(p);
+        if (shift)
+            word = word << shift | p[8] >> (8 - shift);
+        data = _pext_u64(word, 0x5555555555555555ULL);
+        out[0] = data >> 24;
+        out[1] = data >> 16;
+        out[2] = data >> 8;
+        out[3] = data;
+        out += 4;
+        p += 8;
+    }
+    mfm_decode_scalar(out, p, shift, nbytes);
+}
+
+/*
+ * SSE2: eight data bytes from sixteen raw bytes.
+ * Each raw byte is compacted to a nibble with masks and shifts,
+ * then pairs of nibbles are merged and packed.
+ */
+__attribute__((target("sse2")))
+static void decode_sse2(unsigned char *out, const unsigned char *raw,
+    int halfbit, int nbytes)
+{
+    const unsigned char *p = raw + (halfbit >> 3);
+    int shift = halfbit & 7;
+    __m128i v, next, lane;
+    const __m128i m55 = _mm_set1_epi8(0x55);
+    const __m128i m33 = _mm_set1_epi8(0x33);
+    const __m128i m0f = _mm_set1_epi8(0x0f);
+    const __m128i mff = _mm_set1_epi16(0x00ff);
+    const __m128i hi = _mm_set1_epi8((char) (0xff << shift));
+    const __m128i lo = _mm_set1_epi8(0xff >> (8 - shift));
+    const __m128i sl = _mm_cvtsi32_si128(shift);
+    const __m128i sr = _mm_cvtsi32_si128(8 - shift);
+
+    for (; nbytes >= 8; nbytes -= 8) {
+        v = _mm_loadu_si128((const __m128i*) p);
+        if (shift) {
+            /* Align to the halfbit: take bits from the next byte. */
+            next = _mm_loadu_si128((const __m128i*) (p + 1));
+            v = _mm_or_si128(_mm_and_si128(_mm_sll_epi16(v, sl), hi),
+                             _mm_and_si128(_mm_srl_epi16(next, sr), lo));
+        }
+        v = _mm_and_si128(v, m55);
+        v = _mm_and_si128(_mm_or_si128(v, _mm_srli_epi16(v, 1)), m33);
+        v = _mm_and_si128(_mm_or_si128(v, _mm_srli_epi16(v, 2)), m0f);
+
+        /* First raw byte gives the high nibble. */
+        lane = _mm_or_si128(_mm_slli_epi16(v, 4), _mm_srli_epi16(v, 8));
+        lane = _mm_and_si128(lane, mff);
+        _mm_storel_epi64((__m128i*) out, _mm_packus_epi16(lane, lane));
+        out += 8;
+        p += 16;
+    }
+    mfm_decode_scalar(out, p, shift, nbytes);
+}
+
+/*
+ * AVX2: sixteen data bytes from thirty-two raw bytes.
+ */
+__attribute__((target("avx2")))
+static void decode_avx2(unsigned char *out, const unsigned char *raw,
+    int halfbit, int nbytes)
+{
+    const unsigned char *p = raw + (halfbit >> 3);
+    int shift = halfbit & 7;
+    __m256i v, next, lane;
+    const __m256i m55 = _mm256_set1_epi8(0x55);
+    const __m256i m33 = _mm256_set1_epi8(0x33);
+    const __m256i m0f = _mm256_set1_epi8(0x0f);
+    const __m256i mff = _mm256_set1_epi16(0x00ff);
+    const __m256i hi = _mm256_set1_epi8((char) (0xff << shift));
+    const __m256i lo = _mm256_set1_epi8(0xff >> (8 - shift));
+    const __m128i sl = _mm_cvtsi32_si128(shift);
+    const __m128i sr = _mm_cvtsi32_si128(8 - shift);
+
+    for (; nbytes >= 16; nbytes -= 16) {
+        v = _mm256_loadu_si256((const __m256i*) p);
+        if (shift) {
+            next = _mm256_loadu_si256((const __m256i*) (p + 1));
+            v = _mm256_or_si256(_mm256_and_si256(_mm256_sll_epi16(v, sl), hi),
+                                _mm256_and_si256(_mm256_srl_epi16(next, sr), lo));
+        }
+        v = _mm256_and_si256(v, m55);
+        v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi16(v, 1)), m33);
+        v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi16(v, 2)), m0f);
+
+        lane = _mm256_or_si256(_mm256_slli_epi16(v, 4), _mm256_srli_epi16(v, 8));
+        lane = _mm256_and_si256(lane, mff);
+        lane = _mm256_packus_epi16(lane, lane);
+        lane = _mm256_permute4x64_epi64(lane, 0x08);
+        _mm_storeu_si128((__m128i*) out, _mm256_castsi256_si128(lane));
+        out += 16;
+        p += 32;
+    }
+    decode_sse2(out, p, shift, nbytes);
+}
+#endif
+
+static const struct {
+    const char *name;
+    decode_func_t *func;
+    const char *cpu;            /* required CPU feature, or 0 */
+} kernels[] = {
+    /* In order of preference.  PEXT is slower than the AVX2 lanes
+     * on Intel and microcoded on AMD before Zen 3, so bmi2 is used
+     * only when AVX2 is missing. */
+#ifdef HAVE_X86_KERNELS
+    { "avx2",   decode_avx2,        "avx2"  },
+    { "bmi2",   decode_bmi2,        "bmi2"  },
+    { "sse2",   decode_sse2,        "sse2"  },
+#endif
+    { "scalar", mfm_decode_scalar,  0       },
+};
+
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static decode_func_t *decode_func;
+static const char *decode_name;
+
+/*
+ * Check whether the CPU supports the given feature.
+ */
+static int cpu_supports(const char *cpu)
+{
+    if (! cpu)
+        return 1;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (strcmp(cpu, "bmi2") == 0)
+        return __builtin_cpu_supports("bmi2");
+    if (strcmp(cpu, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(cpu, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+#endif
+    return 0;
+}
+
+/*
+ * Select the decoding kernel by name, or the best one
+ * supported by this CPU when name is 0.
+ * Return -1 when the requested kernel is not available.
+ */
+int mfm_decode_select(const char *name)
+{
+    unsigned i;
+
+    for (i=0; i<NKERNELS; ++i) {
+        if (name && strcmp(name, kernels[i].name) != 0)
+            continue;
+        if (! cpu_supports(kernels[i].cpu))
+            continue;
+        decode_func = kernels[i].func;
+        decode_name = kernels[i].name;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Name of the currently selected kernel.
+ */
+const char *mfm_decode_kernel()
+{
+    if (! decode_func)
+        mfm_decode_select(0);
+    return decode_name;
+}
+
+/*
+ * Decode nbytes of data from raw MFM bytes,
+ * starting at the given halfbit.
+ */
+void mfm_decode(unsigned char *out, const unsigned char *raw,
+    int halfbit, int nbytes)
+{
+    if (! decode_func)
+        mfm_decode_select(0);
+    decode_func(out, raw, halfbit, nbytes);
+}
@@ -0,0 +1,303 @@
+/*
+ * Detect the format and geometry of an MFM image.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "mfm.h"
+
+#define AMIGA_HEADER    24      /* info, label and header sum, decoded bytes */
+
+/*
+ * What one sampled track looks like.
+ */
+typedef struct {
+    int format;                 /* MFM_FORMAT_..., by the majority of headers */
+    int good [MFM_NFORMATS];    /* headers with a good checksum */
+    int bad [MFM_NFORMATS];     /* headers with a bad one */
+    int index_mark;             /* C2 index mark found */
+    int nsectors;               /* highest sector number, plus one for Amiga */
+    int size;                   /* size code of the last good IBM header */
+} sample_t;
+
+typedef struct {
+    char wanted [MAXTRACK];     /* tracks in the sample */
+    int list [MAXTRACK];        /* the same, in order */
+    int nlist;
+    sample_t track [MAXTRACK];
+} sample_set_t;
+
+/*
+ * Check the IBM ID field after a run of A1 at halfbit:
+ * FE, C/H/R/N and the CRC.  Return 1 for a good header,
+ * 0 for a bad checksum and -1 when it is not an ID field.
+ */
+static int ibm_header(const unsigned char *data, int nhalfbits, int halfbit,
+    sample_t *st)
+{
+    unsigned char id [7];
+
+    if (halfbit + 7*16 > nhalfbits)
+        return -1;
+    mfm_decode(id, data, halfbit, 7);
+    if (id[0] != 0xfe)
+        return -1;
+    if (mfm_crc16_ccitt(0xb230, id + 1, 4) != (id[5] << 8 | id[6]))
+        return 0;
+    if (id[3] > st->nsectors)
+        st->nsectors = id[3];
+    st->size = id[4];
+    return 1;
+}
+
+/*
+ * Check the Amiga sector header after 00-A1-A1 at halfbit:
+ * the info longword, the label and the header checksum.
+ * Return 1 for a good header, 0 for a bad checksum and -1
+ * when it is not a header.
+ */
+static int amiga_header(const unsigned char *data, int nhalfbits, int halfbit,
+    sample_t *st)
+{
+    unsigned char h [AMIGA_HEADER];
+    unsigned long sum, expect;
+    int i, sector;
+
+    if (halfbit + AMIGA_HEADER*16 > nhalfbits)
+        return -1;
+    mfm_decode(h, data, halfbit, AMIGA_HEADER);
+    if ((h[0] & 0xf0) != 0xf0)
+        return -1;
+    sum = 0;
+    for (i=0; i<AMIGA_HEADER-4; i+=2)
+        sum ^= h[i] << 8 | h[i+1];
+    expect = (unsigned long) h[20] << 24 | h[21] << 16 | h[22] << 8 | h[23];
+    if (sum != expect)
+        return 0;
+    sector = mfm_amiga_unshuffle(h[0] << 8 | h[1], h[2] << 8 | h[3]) >> 8 & 0xff;
+    if (sector + 1 > st->nsectors)
+        st->nsectors = sector + 1;
+    return 1;
+}
+
+/*
+ * Look at all sync words of one track in a single pass.
+ * Three A1 after a zero byte start IBM fields, three C2 are IBM
+ * index marks, and two A1 after a zero byte start Amiga sectors.
+ * Marks are confirmed by their decoded bytes, like the sector
+ * scanners do.  The track votes for the format with more good headers.
+ */
+static int sample_track(mfm_reader_t *reader, void *arg)
+{
+    sample_set_t *d = arg;
+    sample_t *st = &d->track[reader->track];
+    const unsigned char *data = reader->data;
+    int nhalfbits = reader->nhalfbits;
+    int halfbit, sync, mark, format, r;
+
+    memset(st, 0, sizeof(*st));
+    for (halfbit = 0; ; ++halfbit) {
+        halfbit = mfm_sync_search(data, nhalfbits, halfbit, &sync);
+        if (halfbit < 0)
+            break;
+        mark = mfm_sync_mark(data, nhalfbits, halfbit, 0, 3);
+        if (sync != MFM_SYNC_A1) {
+            if (mark >= 0) {
+                st->index_mark = 1;
+                halfbit = mark + 47;
+            }
+            continue;
+        }
+        if (mark >= 0) {
+            format = MFM_FORMAT_IBMPC;
+            r = ibm_header(data, nhalfbits, mark + 48, st);
+            halfbit = mark + 47;
+        } else {
+            mark = mfm_sync_mark(data, nhalfbits, halfbit, -16, 2);
+            if (mark < 0)
+                continue;
+            format = MFM_FORMAT_AMIGA;
+            r = amiga_header(data, nhalfbits, mark + 32, st);
+            halfbit = mark + 31;
+        }
+        if (r > 0)
+            st->good[format]++;
+        else if (r == 0)
+            st->bad[format]++;
+    }
+    if (st->good[MFM_FORMAT_IBMPC] > st->good[MFM_FORMAT_AMIGA])
+        st->format = st->index_mark ? MFM_FORMAT_IBMPC : MFM_FORMAT_BK;
+    else if (st->good[MFM_FORMAT_AMIGA] > 0)
+        st->format = MFM_FORMAT_AMIGA;
+    return 0;
+}
+
+/*
+ * Number of tracks in the image, from its size when it is mapped.
+ */
+static int image_tracks(mfm_image_t *img)
+{
+    if (! img->map || img->size / TRACKSZ >= MAXTRACK)
+        return MAXTRACK;
+    return (img->size + TRACKSZ - 1) / TRACKSZ;
+}
+
+/*
+ * The most frequent nonzero value of v[] over tracks of the format.
+ */
+static int majority(sample_set_t *d, int format, int ntracks, int size)
+{
+    int count [256], t, v, best;
+
+    memset(count, 0, sizeof(count));
+    for (t=0; t<ntracks; ++t) {
+        if (! d->wanted[t] || d->track[t].format != format)
+            continue;
+        v = size ? d->track[t].size : d->track[t].nsectors;
+        if (v > 0 && v < 256)
+            count[v]++;
+    }
+    best = 0;
+    for (v=1; v<256; ++v)
+        if (count[v] > count[best])
+            best = v;
+    return best;
+}
+
+/*
+ * Detect the format of the image from a sample of about nsample
+ * tracks: both sides of the first and the last cylinder and of
+ * cylinders evenly spaced between them, in one pass over the image.
+ * Every sampled track is checked for IBM, BK and Amiga headers
+ * at once.  The confidence is the share of nonblank sampled
+ * tracks of the winning format, scaled by the share of its
+ * headers with a good checksum.
+ */
+void mfm_detect(mfm_image_t *img, int nsample, mfm_detect_t *res)
+{
+    sample_set_t *d;
+    int ntracks, ncylinders, npairs, nblank, good, bad, last, t, i, f;
+
+    d = calloc(1, sizeof(sample_set_t));
+    if (! d) {
+        fprintf(stderr, "Out of memory, aborted.\n");
+        exit(-1);
+    }
+    ntracks = image_tracks(img);
+    ncylinders = (ntracks + 1) / 2;
+    npairs = (nsample + 1) / 2;
+    if (npairs < 2)
+        npairs = 2;
+    if (npairs > ncylinders)
+        npairs = ncylinders;
+    for (i=0; i<npairs; ++i) {
+        t = (npairs > 1) ? 2 * ((ncylinders - 1) * i / (npairs - 1)) : 0;
+        d->wanted[t] = 1;
+        if (t + 1 < ntracks)
+            d->wanted[t + 1] = 1;
+    }
+
+    /* Only the sampled tracks are read, all in one pass. */
+    for (t=0; t<ntracks; ++t)
+        if (d->wanted[t])
+            d->list[d->nlist++] = t;
+    mfm_for_track_list(img, d->list, d->nlist, sample_track, d);
+
+    memset(res, 0, sizeof(*res));
+    nblank = 0;
+    last = -1;
+    for (t=0; t<ntracks; ++t) {
+        if (! d->wanted[t])
+            continue;
+        res->nsampled++;
+        f = d->track[t].format;
+        res->votes[f]++;
+        if (f != MFM_FORMAT_UNKNOWN) {
+            last = t;
+            if (t & 1)
+                res->nheads = 2;
+        } else if (! d->track[t].bad[MFM_FORMAT_IBMPC] &&
+                   ! d->track[t].bad[MFM_FORMAT_AMIGA])
+            nblank++;
+    }
+
+    f = MFM_FORMAT_UNKNOWN;
+    for (i=1; i<MFM_NFORMATS; ++i)
+        if (res->votes[i] > (f ? res->votes[f] : 0))
+            f = i;
+    /*
+     * BK differs from IBM PC only by the missing index mark,
+     * so tracks of one count for the layout of the other.
+     * Call it BK only when most tracks have no index mark.
+     */
+    if (f == MFM_FORMAT_BK &&
+        res->votes[MFM_FORMAT_IBMPC] * 2 >= res->votes[MFM_FORMAT_BK])
+        f = MFM_FORMAT_IBMPC;
+    res->format = f;
+    res->mixed = res->votes[MFM_FORMAT_AMIGA] > 0 &&
+        res->votes[MFM_FORMAT_IBMPC] + res->votes[MFM_FORMAT_BK] > 0;
+    if (f == MFM_FORMAT_UNKNOWN) {
+        free(d);
+        return;
+    }
+
+    res->nheads = res->nheads ? 2 : 1;
+    res->ncylinders = last / 2 + 1;
+    res->nsectors_per_track = majority(d, f, ntracks, 0);
+    res->size = (f == MFM_FORMAT_AMIGA) ? 2 : majority(d, f, ntracks, 1);
+
+    i = (f == MFM_FORMAT_AMIGA) ? MFM_FORMAT_AMIGA : MFM_FORMAT_IBMPC;
+    good = bad = 0;
+    for (t=0; t<ntracks; ++t) {
+        if (d->wanted[t]) {
+            good += d->track[t].good[i];
+            bad += d->track[t].bad[i];
+        }
+    }
+    t = res->votes[f];
+    if (f == MFM_FORMAT_IBMPC)
+        t += res->votes[MFM_FORMAT_BK] / 2;
+    else if (f == MFM_FORMAT_BK)
+        t += res->votes[MFM_FORMAT_IBMPC] / 2;
+    res->confidence = (long) 100 * t * good /
+        ((res->nsampled - nblank) * (good + bad));
+    free(d);
+}
+
+/*
+ * Name of the format for messages.
+ */
+const char *mfm_format_name(int format)
+{
+    switch (format) {
+    case MFM_FORMAT_IBMPC: return "IBM PC";
+    case MFM_FORMAT_AMIGA: return "Amiga";
+    case MFM_FORMAT_BK:    return "BK-0010";
+    }
+    return "unknown";
+}
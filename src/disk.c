@@ -0,0 +1,232 @@
+/*
+ * Floppy disk model: geometry, sector state and data.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "config.h"
+#include "mfm.h"
+
+/*
+ * Allocate a disk of the given geometry in one block:
+ * the header, the track table and the data arena.
+ * The arena is page-aligned, so that it can be written
+ * with O_DIRECT.  All sectors get the size code size
+ * and are zeroed.
+ */
+mfm_disk_t *mfm_disk_alloc(int ntracks, int nsectors_per_track, int size)
+{
+    return mfm_disk_alloc_rows(ntracks, nsectors_per_track, size, ntracks);
+}
+
+/*
+ * Allocate a disk which holds the data of only nrows tracks,
+ * used in turn: track t lives in row t % nrows.  This is enough
+ * for streaming, when each track is written out before the track
+ * nrows later is read in.
+ */
+mfm_disk_t *mfm_disk_alloc_rows(int ntracks, int nsectors_per_track, int size,
+    int nrows)
+{
+    mfm_disk_t *d;
+    size_t header, nbytes;
+    int t, s;
+
+    if (nrows > ntracks)
+        nrows = ntracks;
+    header = sizeof(mfm_disk_t) + ntracks * sizeof(mfm_track_t);
+    header = (header + 4095) & ~(size_t) 4095;
+    nbytes = (size_t) nrows * nsectors_per_track * (128 << size);
+    d = mfm_output_alloc(header + nbytes);
+    memset(d, 0, header + nbytes);
+    d->ntracks = ntracks;
+    d->nrows = nrows;
+    d->nsectors_per_track = nsectors_per_track;
+    d->size = size;
+    d->sector_bytes = 128 << size;
+    d->track = (mfm_track_t*) (d + 1);
+    d->data = (unsigned char*) d + header;
+    for (t=0; t<ntracks; ++t)
+        for (s=0; s<nsectors_per_track; ++s)
+            d->track[t].size[s] = size;
+    return d;
+}
+
+void mfm_disk_free(mfm_disk_t *d)
+{
+    free(d);
+}
+
+/*
+ * Data of sector s on track t.
+ */
+unsigned char *mfm_disk_sector(mfm_disk_t *d, int t, int s)
+{
+    if (d->nrows < d->ntracks)
+        t %= d->nrows;
+    return d->data + ((size_t) t * d->nsectors_per_track + s) * d->sector_bytes;
+}
+
+/*
+ * Prepare a track buffer for decoding track t.
+ */
+void mfm_track_clear(mfm_track_data_t *td, int t)
+{
+    memset(&td->info, 0, sizeof(td->info));
+    td->track = t;
+    td->nbytes = 0;
+}
+
+/*
+ * Add sector s of 128 << size bytes to the track buffer.
+ * A repeated sector replaces the previous copy.
+ * Return the place for its data, or 0 when there is no room.
+ */
+unsigned char *mfm_track_add(mfm_track_data_t *td, int s, int size, int bad_crc)
+{
+    int nbytes = 128 << size;
+    uint32_t mask = (uint32_t) 1 << s;
+
+    if (! (td->info.present & mask) || td->info.size[s] != size) {
+        if (td->nbytes + nbytes > (int) sizeof(td->data))
+            return 0;
+        td->offset[s] = td->nbytes;
+        td->nbytes += nbytes;
+    }
+    td->info.present |= mask;
+    if (bad_crc)
+        td->info.bad_crc |= mask;
+    else
+        td->info.bad_crc &= ~mask;
+    td->info.size[s] = size;
+    return td->data + td->offset[s];
+}
+
+/*
+ * Data of sector s in the track buffer, or 0 when it was not read.
+ */
+unsigned char *mfm_track_sector(mfm_track_data_t *td, int s)
+{
+    if (! (td->info.present >> s & 1))
+        return 0;
+    return td->data + td->offset[s];
+}
+
+/*
+ * Size code of the first sector on the track, 2 when there are none.
+ */
+int mfm_track_size(mfm_track_data_t *td)
+{
+    int s;
+
+    for (s=0; s<MAXSECT; ++s)
+        if (td->info.present >> s & 1)
+            return td->info.size[s];
+    return 2;
+}
+
+/*
+ * Copy sector s from the track buffer into a slot of slot_bytes,
+ * padding it with zeros.  A sector which does not fit is truncated.
+ */
+static void fill_slot(unsigned char *slot, int slot_bytes,
+    mfm_track_data_t *td, int s)
+{
+    const unsigned char *data = mfm_track_sector(td, s);
+    int nbytes;
+
+    if (! data) {
+        memset(slot, 0, slot_bytes);
+        return;
+    }
+    nbytes = 128 << td->info.size[s];
+    if (nbytes > slot_bytes) {
+        fprintf(mfm_err, "Track %d/%d sector %d: size %d does not fit into %d bytes\n",
+            td->track >> 1, td->track & 1, s + 1, nbytes, slot_bytes);
+        nbytes = slot_bytes;
+    }
+    memcpy(slot, data, nbytes);
+    memset(slot + nbytes, 0, slot_bytes - nbytes);
+}
+
+/*
+ * Store the decoded track into the disk.
+ * Sectors beyond the disk geometry are dropped.
+ */
+void mfm_disk_put_track(mfm_disk_t *d, int t, mfm_track_data_t *td)
+{
+    mfm_track_t *tr = &d->track[t];
+    uint32_t mask;
+    int s;
+
+    mask = (d->nsectors_per_track < 32) ?
+        ((uint32_t) 1 << d->nsectors_per_track) - 1 : ~(uint32_t) 0;
+    tr->present = td->info.present & mask;
+    tr->bad_crc = td->info.bad_crc & mask;
+    for (s=0; s<d->nsectors_per_track; ++s) {
+        fill_slot(mfm_disk_sector(d, t, s), d->sector_bytes, td, s);
+        if (tr->present >> s & 1)
+            tr->size[s] = td->info.size[s];
+    }
+}
+
+/*
+ * Write the decoded track in binary image form:
+ * nsectors_per_track slots of 128 << size bytes,
+ * with one vectored write straight from the track buffer.
+ * Missing sectors and the tails of short ones are zeros.
+ */
+void mfm_write_raw_track(mfm_track_data_t *td, int nsectors_per_track,
+    int size, FILE *fout)
+{
+    static const unsigned char zero [MAXSECTSZ];
+    struct iovec iov [2 * MAXSECT];
+    const unsigned char *data;
+    int slot_bytes = 128 << size, nbytes, s, n = 0;
+
+    for (s=0; s<nsectors_per_track; ++s) {
+        data = mfm_track_sector(td, s);
+        nbytes = data ? 128 << td->info.size[s] : 0;
+        if (nbytes > slot_bytes) {
+            fprintf(mfm_err, "Track %d/%d sector %d: size %d does not fit into %d bytes\n",
+                td->track >> 1, td->track & 1, s + 1, nbytes, slot_bytes);
+            nbytes = slot_bytes;
+        }
+        if (nbytes > 0) {
+            iov[n].iov_base = (void*) data;
+            iov[n].iov_len = nbytes;
+            n++;
+        }
+        if (nbytes < slot_bytes) {
+            iov[n].iov_base = (void*) zero;
+            iov[n].iov_len = slot_bytes - nbytes;
+            n++;
+        }
+    }
+    mfm_output_writev(fout, iov, n);
+}
@@ -0,0 +1,152 @@
+/*
+ * Render the raw contents of MFM tracks as text.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "mfm.h"
+
+/*
+ * Each raw byte holds four clock/data halfbit pairs, so a track
+ * is rendered a byte at a time through tables built on first use.
+ *
+ * Cell symbols: a data bit with a proper clock is printed as 0 or 1,
+ * a missing clock as '_' and a clock with a data bit as '#'.
+ * The clock of a 0 following a 1 is implied, so the symbol of a pair
+ * depends on the data bit before it: cell_tab is indexed by that
+ * bit, and cell_last gives the last data bit of the byte.
+ */
+static char cell_tab [2] [256] [4];
+static unsigned char cell_last [2] [256];
+static char halfbit_tab [256] [8];
+static char hex_tab [256] [2];
+
+static void dump_init()
+{
+    static const char digits[] = "0123456789abcdef";
+    int last, byte, k, a, b, prev;
+
+    for (last=0; last<2; ++last) {
+        for (byte=0; byte<256; ++byte) {
+            prev = last;
+            for (k=0; k<4; ++k) {
+                a = byte >> (7 - 2*k) & 1;
+                b = byte >> (6 - 2*k) & 1;
+                if (! a && ! b && prev)
+                    a = 1;
+                cell_tab[last][byte][k] = (a != b) ? '0' + b : (b ? '#' : '_');
+                prev = b;
+            }
+            cell_last[last][byte] = prev;
+        }
+    }
+    for (byte=0; byte<256; ++byte) {
+        for (k=0; k<8; ++k)
+            halfbit_tab[byte][k] = '0' + (byte >> (7 - k) & 1);
+        hex_tab[byte][0] = digits[byte >> 4];
+        hex_tab[byte][1] = digits[byte & 15];
+    }
+}
+
+/*
+ * Cells of the track, 64 per line.  In verbose mode every halfbit
+ * is printed as is.
+ */
+static char *render_cells(char *p, const unsigned char *raw, int nbytes)
+{
+    int i, last = 0;
+
+    for (i=0; i<nbytes; ++i) {
+        if (mfm_verbose) {
+            memcpy(p, halfbit_tab[raw[i]], 8);
+            p += 8;
+            if ((i & 7) == 7)
+                *p++ = '\n';
+        } else {
+            memcpy(p, cell_tab[last][raw[i]], 4);
+            last = cell_last[last][raw[i]];
+            p += 4;
+            if ((i & 15) == 15)
+                *p++ = '\n';
+        }
+    }
+    *p++ = '\n';
+    return p;
+}
+
+/*
+ * Raw track bytes in hex, 32 per line, each line prefixed
+ * with the byte offset.
+ */
+static char *render_hex(char *p, const unsigned char *raw, int nbytes)
+{
+    int i;
+
+    for (i=0; i<nbytes; ++i) {
+        if ((i & 31) == 0)
+            p += sprintf(p, "%04x: ", i);
+        memcpy(p, hex_tab[raw[i]], 2);
+        p += 2;
+        if ((i & 31) == 31 || i == nbytes - 1)
+            *p++ = '\n';
+    }
+    return p;
+}
+
+/*
+ * Render one track into a buffer and print it with a single write.
+ * A short track ends the dump.
+ */
+static int dump_track(mfm_reader_t *reader, void *arg)
+{
+    int format = *(int*) arg;
+    char *buf, *p;
+
+    buf = malloc(32 + 9 * (size_t) reader->nbytes);
+    if (! buf) {
+        fprintf(stderr, "Out of memory, aborted.\n");
+        exit(-1);
+    }
+    p = buf + sprintf(buf, "Track %d/%d:\n", reader->track >> 1, reader->track & 1);
+    if (format == MFM_DUMP_HEX)
+        p = render_hex(p, reader->data, reader->nbytes);
+    else
+        p = render_cells(p, reader->data, reader->nbytes);
+    fwrite(buf, 1, p - buf, mfm_err);
+    free(buf);
+    return reader->nbytes < TRACKSZ;
+}
+
+/*
+ * Print tracks from first to last-1 in the given format.
+ */
+void mfm_dump(mfm_image_t *img, int first, int last, int format)
+{
+    dump_init();
+    mfm_for_each_track(img, first, last, dump_track, &format);
+}
@@ -31,65 +31,6 @@
 #include "config.h"
 #include "mfm.h"
 
-/*
- * Checksum lookup table.
- * CRC-CCITT = x^16 + x^12 + x^5 + 1
- */
-static const unsigned short poly_tab [256] = {
-    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
-    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
-    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
-    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
-    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
-    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
-    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
-    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
-    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
-    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
-    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
-    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
-    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
-    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
-    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
-    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
-    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
-    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
-    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
-    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
-    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
-    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
-    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
-    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
-    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
-    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
-    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
-    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
-    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
-    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
-    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
-    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
-};
-
-/*
- * Calculate a new sum given the current sum and the new data.
- * Use 0xffff as the initial sum value.
- * Do not forget to invert the final checksum value.
- */
-static unsigned short crc16_ccitt(unsigned short sum,
-    unsigned const char *buf, unsigned int len)
-{
-    while (len--) {
-        sum = (sum << 8) ^ poly_tab [*buf++ ^ (sum >> 8)];
-    }
-    return sum;
-}
-
-static unsigned short crc16_ccitt_byte(unsigned short sum, unsigned char byte)
-{
-    sum = (sum << 8) ^ poly_tab [byte ^ (sum >> 8)];
-    return sum;
-}
-
 static int print_gap(unsigned long history, int printed)
 {
     int byte;
@@ -115,56 +56,107 @@ static int print_gap(unsigned long history, int printed)
 }
 
 /*
- * Поиск идентификатора сектора на дискете формата IBM PC.
+ * Печать заполнения зазора от текущего места до полубита end
+ * (режим -vv).  Дорожку декодируем побитно, как при поиске.
  */
-int mfm_scan_ibmpc(mfm_reader_t *reader, int *nbits_read)
+static void print_gaps(mfm_reader_t *reader, int end)
 {
-    int bit, tag, gap_printed = 0;
+    int byte, n, i, skip, halfbit, gap_printed = 0;
     unsigned long history;
 
+    halfbit = reader->halfbit;
     history = 0x13713713;
-    if (nbits_read)
-        *nbits_read = 0;
-    for (;;) {
-        bit = mfm_read_bit(reader);
-        if (bit < 0) {
-            if (mfm_verbose && nbits_read)
-                fprintf(mfm_err, "Track %d/%d: final gap %d bits\n",
-                    reader->track >> 1, reader->track & 1, *nbits_read);
-            return -1;
+    while (reader->halfbit + 2 <= end) {
+        /* Декодируем сразу байт, конец зазора - побитно. */
+        byte = mfm_peek_byte(reader);
+        if (byte >= 0 && reader->halfbit + 16 <= end) {
+            n = 8;
+        } else {
+            n = 1;
+            byte = mfm_peek_bits(reader, 2) << 7 & 0x80;
         }
-        history = history << 1 | bit;
-        history &= 0xffffffff;
-        if (nbits_read)
-            ++*nbits_read;
-
-        /* Все единицы - подсинхронизовываемся на полубит. */
-        if (history == 0xffffffff) {
-            mfm_read_halfbit(reader);
-            history = 0;
-            continue;
-        }
-
-        if (mfm_verbose > 1)
+        skip = 2*n;
+        for (i=0; i<n; ++i) {
+            history = history << 1 | (byte >> (7-i) & 1);
+            history &= 0xffffffff;
+
+            /* Все единицы - подсинхронизовываемся на полубит. */
+            if (history == 0xffffffff) {
+                skip = 2*(i+1) + 1;
+                history = 0;
+                break;
+            }
             gap_printed = print_gap(history, gap_printed);
+        }
+        mfm_skip_bits(reader, skip);
+    }
+    reader->halfbit = halfbit;
+}
 
-        /* Формат IBM PC: ждем 00-a1-a1-a1 или 00-c2-c2-c2. */
-        if (history == 0x00a1a1a1 || history == 0x00c2c2c2) {
+/*
+ * Поиск идентификатора сектора на дискете формата IBM PC:
+ * ждем 00-a1-a1-a1 или 00-c2-c2-c2, где a1 и c2 записаны
+ * с нарушением кодирования.  Синхрослова ищем сразу в сыром
+ * MFM-потоке, а маркер проверяем по декодированным байтам,
+ * так что сбой одного бита синхронизации не теряет сектор.
+ */
+int mfm_scan_ibmpc(mfm_reader_t *reader, int *nbits_read)
+{
+    int start, halfbit, mark;
+
+    start = reader->halfbit;
+    for (halfbit = start; ; ++halfbit) {
+        halfbit = mfm_sync_search(reader->data, reader->nhalfbits,
+            halfbit, 0);
+        if (halfbit < 0)
+            break;
+
+        /* Три одинаковых байта после нулевого. */
+        mark = mfm_sync_mark(reader->data, reader->nhalfbits, halfbit, start, 3);
+        if (mark >= 0) {
             /* Нашли маркер, читаем и возвращаем его тег. */
-            tag = mfm_read_byte(reader);
-            return tag;
+            if (mfm_verbose > 1)
+                print_gaps(reader, mark + 48);
+            reader->halfbit = mark + 48;
+            if (nbits_read)
+                *nbits_read = (reader->halfbit - start) / 2;
+            mfm_stat_add(MFM_STAT_MARKS, 1);
+            MFM_TRACE(MFM_EV_MARK, reader->track, mark, mfm_peek_byte(reader));
+            return mfm_read_byte(reader);
         }
     }
+    if (mfm_verbose > 1)
+        print_gaps(reader, reader->nhalfbits);
+    reader->halfbit = reader->nhalfbits;
+    if (nbits_read) {
+        *nbits_read = (reader->halfbit - start) / 2;
+        if (mfm_verbose)
+            fprintf(mfm_err, "Track %d/%d: final gap %d bits\n",
+                reader->track >> 1, reader->track & 1, *nbits_read);
+    }
+    return -1;
 }
 
+/*
+ * Выбор места для данных сектора s размером 128 << size байт:
+ * вызывается, когда заголовок и метка данных уже прочитаны.
+ */
+typedef unsigned char *place_func_t(void *arg, int s, int size);
+
 /*
  * Чтение очередного сектора с дискеты формата IBM PC.
+ * Размер данных (128 << size байт) берётся из идентификатора,
+ * данные декодируются за один проход вместе с подсчётом
+ * контрольной суммы прямо в буфер, который выдаёт place.
+ * Код размера и признак ошибки контрольной суммы возвращаются
+ * через size_code и bad_crc.
  */
-int mfm_read_sector_ibmpc(mfm_reader_t *reader, unsigned char *data,
-    int *sector_gap, int *data_gap)
+static int read_sector(mfm_reader_t *reader, place_func_t *place, void *arg,
+    int *size_code, int *bad_crc, int *sector_gap, int *data_gap)
 {
-    int tag, cylinder, head, track, sector, size, gap, i;
+    int tag, cylinder, head, track, sector, size, nbytes, gap;
     unsigned short header_sum, data_sum, my_header_sum, my_data_sum;
+    unsigned char *data;
 
     if (sector_gap)
         *sector_gap = 0;
@@ -193,11 +185,12 @@ ident:  cylinder = mfm_read_byte(reader);
         header_sum = mfm_read_byte(reader) << 8;
         header_sum |= mfm_read_byte(reader);
 
-        my_header_sum = crc16_ccitt_byte(0xb230, cylinder);
-        my_header_sum = crc16_ccitt_byte(my_header_sum, head);
-        my_header_sum = crc16_ccitt_byte(my_header_sum, sector);
-        my_header_sum = crc16_ccitt_byte(my_header_sum, size);
+        my_header_sum = mfm_crc16_byte(0xb230, cylinder);
+        my_header_sum = mfm_crc16_byte(my_header_sum, head);
+        my_header_sum = mfm_crc16_byte(my_header_sum, sector);
+        my_header_sum = mfm_crc16_byte(my_header_sum, size);
         if (my_header_sum != header_sum) {
+            mfm_stat_add(MFM_STAT_HEADER_CRC, 1);
             fprintf(mfm_err, "Track %d/%d: header sum %04x, expected %04x\n",
                 reader->track >> 1, reader->track & 1,
                 my_header_sum, header_sum);
@@ -209,10 +202,12 @@ ident:  cylinder = mfm_read_byte(reader);
                 reader->track >> 1, reader->track & 1,
                 sector, cylinder, head);
         }
-        if (size != 2) {
+        if (size > MAXSIZE) {
             fprintf(mfm_err, "Track %d/%d sector %d: incorrect block size = %d\n",
                 reader->track >> 1, reader->track & 1, sector, size);
+            size = 2;
         }
+        nbytes = 128 << size;
         tag = mfm_scan_ibmpc(reader, data_gap);
         if (tag < 0)
             return -1;
@@ -228,157 +223,310 @@ ident:  cylinder = mfm_read_byte(reader);
             fprintf(mfm_err, "Track %d/%d sector %d: invalid tag %02X\n",
                 reader->track >> 1, reader->track & 1, sector, tag);
         }
-        for (i=0; i<SECTSZ; ++i)
-            data[i] = mfm_read_byte(reader);
+        data = place(arg, sector - 1, size);
+        my_data_sum = mfm_crc16_byte(0xcdb4, tag);
+        my_data_sum = mfm_read_bytes_crc(reader, data, nbytes, my_data_sum);
         data_sum = mfm_read_byte(reader) << 8;
         data_sum |= mfm_read_byte(reader);
 
-        my_data_sum = crc16_ccitt_byte(0xcdb4, tag);
-        my_data_sum = crc16_ccitt(my_data_sum, data, SECTSZ);
         if (my_data_sum != data_sum) {
+            mfm_stat_add(MFM_STAT_DATA_CRC, 1);
             fprintf(mfm_err, "Track %d/%d sector %d: data sum %04x, expected %04x\n",
                 reader->track >> 1, reader->track & 1,
                 sector, my_data_sum, data_sum);
         }
+        if (size_code)
+            *size_code = size;
+        if (bad_crc)
+            *bad_crc = (my_data_sum != data_sum);
+        MFM_TRACE(MFM_EV_SECTOR, reader->track, sector - 1, my_data_sum != data_sum);
         return sector - 1;
     }
 }
 
+static unsigned char *place_buffer(void *arg, int s, int size)
+{
+    return arg;
+}
+
 /*
- * Читаем дискету IBM PC из MFM-файла. Количество дорожек (до 160)
- * задаётся параметром ntracks.
+ * Чтение сектора в буфер data размером MAXSECTSZ байт.
  */
-void mfm_read_ibmpc(mfm_disk_t *d, FILE *fin, int ntracks)
+int mfm_read_sector_ibmpc(mfm_reader_t *reader, unsigned char *data,
+    int *size_code, int *bad_crc, int *sector_gap, int *data_gap)
 {
-    int t, s;
-    mfm_reader_t reader;
-    unsigned char block [SECTSZ];
-    int have_sector [MAXSECT];
+    return read_sector(reader, place_buffer, data,
+        size_code, bad_crc, sector_gap, data_gap);
+}
 
-    d->ntracks = ntracks;
-    d->nsectors_per_track = 10;
-    for (t=0; t<d->ntracks; ++t) {
-        mfm_read_seek(&reader, fin, t);
-        for (s=0; s<MAXSECT; ++s)
-            have_sector [s] = 0;
-        for (;;) {
-            s = mfm_read_sector_ibmpc(&reader, block, 0, 0);
-            if (s < 0)
-                break;
-            if (s >= d->nsectors_per_track) {
-                fprintf(mfm_err, "Track %d/%d: too large sector number %d\n",
-                    t >> 1, t & 1, s + 1);
-                continue;
-            }
-            /* Сектора могут следовать в произвольном порядке. */
-            have_sector [s] = 1;
-            memcpy(d->block[t][s], block, SECTSZ);
+/*
+ * Куда read_sectors_ibmpc() кладёт очередной сектор.
+ */
+typedef struct {
+    mfm_track_data_t *td;
+    int nsectors_per_track;
+    int placed;                 /* сектор лёг в буфер дорожки */
+    unsigned char scratch [MAXSECTSZ]; /* для отброшенных секторов */
+} place_track_t;
+
+static unsigned char *place_track(void *arg, int s, int size)
+{
+    place_track_t *pt = arg;
+    unsigned char *p;
+
+    pt->placed = 0;
+    if (s < 0 || s >= pt->nsectors_per_track)
+        return pt->scratch;
+    p = mfm_track_add(pt->td, s, size, 0);
+    if (! p)
+        return pt->scratch;
+    pt->placed = 1;
+    return p;
+}
+
+/*
+ * Чтение секторов одной дорожки IBM PC в буфер дорожки.
+ * Данные декодируются сразу на своё место в буфере.
+ * Сектора с номером больше nsectors_per_track отбрасываются.
+ */
+static void read_sectors_ibmpc(mfm_reader_t *reader, mfm_track_data_t *td,
+    int nsectors_per_track)
+{
+    int t = reader->track, s, bad_crc;
+    place_track_t pt;
+
+    mfm_track_clear(td, t);
+    pt.td = td;
+    pt.nsectors_per_track = nsectors_per_track;
+    for (;;) {
+        s = read_sector(reader, place_track, &pt, 0, &bad_crc, 0, 0);
+        if (s < 0)
+            break;
+        if (s >= nsectors_per_track) {
+            fprintf(mfm_err, "Track %d/%d: too large sector number %d\n",
+                t >> 1, t & 1, s + 1);
+            continue;
+        }
+        /* Сектора могут следовать в произвольном порядке. */
+        if (! pt.placed) {
+            fprintf(mfm_err, "Track %d/%d sector %d: no room, ignored\n",
+                t >> 1, t & 1, s + 1);
+            continue;
         }
-        /* Разпознаём количество секторов. */
-        if (t == 0 && ! have_sector [9])
-            d->nsectors_per_track = 9;
+        if (bad_crc)
+            td->info.bad_crc |= (uint32_t) 1 << s;
+    }
+}
 
-        /* Проверим, что получили все сектора. */
-        for (s=0; s<d->nsectors_per_track; ++s)
-            if (! have_sector [s])
-                break;
-        if (s < d->nsectors_per_track) {
-            fprintf(mfm_err, "Track %d/%d: no sector",
-                t >> 1, t & 1);
-            for (; s<d->nsectors_per_track; ++s)
-                if (! have_sector [s])
-                    fprintf(mfm_err, " %d", s);
-            fprintf(mfm_err, "\n");
+/*
+ * Проверим, что получили все сектора.
+ */
+static void check_sectors_ibmpc(mfm_track_data_t *td, int nsectors_per_track)
+{
+    int t = td->track, s;
+
+    for (s=0; s<nsectors_per_track; ++s)
+        if (! (td->info.present >> s & 1))
+            break;
+    if (s < nsectors_per_track) {
+        fprintf(mfm_err, "Track %d/%d: no sector",
+            t >> 1, t & 1);
+        for (; s<nsectors_per_track; ++s) {
+            if (! (td->info.present >> s & 1)) {
+                mfm_stat_add(MFM_STAT_MISSING, 1);
+                fprintf(mfm_err, " %d", s);
+            }
         }
+        fprintf(mfm_err, "\n");
     }
 }
 
 /*
- * Исследуем и печатаем информацию о дискете IBM PC из MFM-файла.
- * Количество дорожек (до 160) задаётся параметром ntracks.
+ * Разпознаём количество секторов по нулевой дорожке:
+ * наибольший номер сектора. Для 512-байтных секторов
+ * не меньше девяти, как на дискетах IBM PC.
  */
-void mfm_analyze_ibmpc(FILE *fin, int ntracks)
+static int count_sectors_ibmpc(mfm_track_data_t *td)
+{
+    int n;
+
+    n = td->info.present ? 32 - __builtin_clz(td->info.present) : 0;
+    if (n < 9 && mfm_track_size(td) == 2)
+        n = 9;
+    return n;
+}
+
+/*
+ * Чтение одной дорожки IBM PC в образ диска.
+ */
+static int read_track_ibmpc(mfm_reader_t *reader, void *arg)
+{
+    mfm_disk_t *d = arg;
+    mfm_track_data_t td;
+
+    read_sectors_ibmpc(reader, &td, d->nsectors_per_track);
+    check_sectors_ibmpc(&td, d->nsectors_per_track);
+    mfm_disk_put_track(d, reader->track, &td);
+    return 0;
+}
+
+/*
+ * Читаем дискету IBM PC из MFM-файла. Количество дорожек (до 160)
+ * задаётся параметром ntracks. Геометрию диска определяем
+ * по нулевой дорожке, остальные дорожки можно читать параллельно.
+ */
+mfm_disk_t *mfm_read_ibmpc(mfm_image_t *img, int ntracks)
 {
-    int t, s, i, nsectors_per_track;
     mfm_reader_t reader;
-    unsigned char block [SECTSZ];
+    mfm_track_data_t td;
+    mfm_disk_t *d;
+    int nsectors_per_track;
+
+    MFM_TRACE(MFM_EV_TRACK_BEGIN, 0, 0, 0);
+    mfm_read_seek(&reader, img, 0);
+    read_sectors_ibmpc(&reader, &td, MAXSECT);
+    nsectors_per_track = count_sectors_ibmpc(&td);
+    check_sectors_ibmpc(&td, nsectors_per_track);
+    MFM_TRACE(MFM_EV_TRACK_END, 0, 0, 0);
+
+    d = mfm_disk_alloc(ntracks, nsectors_per_track, mfm_track_size(&td));
+    mfm_disk_put_track(d, 0, &td);
+    mfm_for_each_track(img, 1, ntracks, read_track_ibmpc, d);
+    return d;
+}
+
+/*
+ * Декодирование дорожки в потоке. Геометрию определяем
+ * по нулевой дорожке; дорожки приходят строго по порядку.
+ */
+typedef struct {
+    int nsectors_per_track;
+    int size;
+} stream_args_t;
+
+static void stream_track_ibmpc(mfm_stream_slot_t *slot, void *arg)
+{
+    stream_args_t *args = arg;
+
+    read_sectors_ibmpc(&slot->reader, &slot->td, args->nsectors_per_track);
+    if (slot->reader.track == 0) {
+        args->nsectors_per_track = count_sectors_ibmpc(&slot->td);
+        args->size = mfm_track_size(&slot->td);
+    }
+    check_sectors_ibmpc(&slot->td, args->nsectors_per_track);
+    slot->nsectors_per_track = args->nsectors_per_track;
+    slot->size = args->size;
+}
+
+/*
+ * Извлекаем дискету IBM PC из MFM-образа, выдавая сектора каждой
+ * дорожки сразу после её декодирования. Годится для чтения из канала:
+ * в памяти держим только несколько дорожек, а чтение, декодирование
+ * и запись идут одновременно.
+ */
+void mfm_stream_ibmpc(mfm_image_t *img, int ntracks, FILE *fout)
+{
+    stream_args_t args;
+
+    args.nsectors_per_track = MAXSECT;
+    args.size = 2;
+    mfm_stream_tracks(img, ntracks, fout, stream_track_ibmpc, &args);
+}
+
+/*
+ * Исследуем и печатаем информацию об одной дорожке IBM PC.
+ */
+static int analyze_track_ibmpc(mfm_reader_t *reader, void *arg)
+{
+    int t = reader->track, s, i, nsectors_per_track;
+    unsigned char block [MAXSECTSZ];
     int have_sector [MAXSECT];
     int order_of_sectors [MAXSECT];
     int sector_gap [MAXSECT];
     int data_gap [MAXSECT];
 
-    fprintf(mfm_err, "Format: IBM PC\n");
-    for (t=0; t<ntracks; ++t) {
-        fprintf(mfm_err, "\n");
-        mfm_read_seek(&reader, fin, t);
-        for (s=0; s<MAXSECT; ++s)
-            have_sector [s] = 0;
-        nsectors_per_track = 0;
-        for (i=0; ; ++i) {
-            s = mfm_read_sector_ibmpc(&reader, block,
-                &sector_gap[i], &data_gap[i]);
-            if (s < 0)
-                break;
-            if (s >= MAXSECT) {
-                fprintf(mfm_err, "Too many sectors per track = %d, aborted.\n",
-                    s+1);
-                exit(-1);
-            }
-            if (s >= nsectors_per_track)
-                nsectors_per_track = s + 1;
-
-            /* Сектора могут следовать в произвольном порядке. */
-            have_sector [s] = 1;
-            order_of_sectors [i] = s;
+    fprintf(mfm_err, "\n");
+    for (s=0; s<MAXSECT; ++s)
+        have_sector [s] = 0;
+    nsectors_per_track = 0;
+    for (i=0; ; ++i) {
+        s = mfm_read_sector_ibmpc(reader, block, 0, 0,
+            &sector_gap[i], &data_gap[i]);
+        if (s < 0)
+            break;
+        if (s >= MAXSECT) {
+            fprintf(mfm_err, "Too many sectors per track = %d, aborted.\n",
+                s+1);
+            return -1;
         }
-        fprintf(mfm_err, "Track %d/%d: %d sectors per track\n",
-            t >> 1, t & 1, nsectors_per_track);
-        if (nsectors_per_track < 1)
-            continue;
+        if (s >= nsectors_per_track)
+            nsectors_per_track = s + 1;
 
-        fprintf(mfm_err, "Order of sectors:");
-        for (s=0; s<i; ++s) {
-            fprintf(mfm_err, " %d", order_of_sectors[s] + 1);
-        }
-        fprintf(mfm_err, "\n");
+        /* Сектора могут следовать в произвольном порядке. */
+        have_sector [s] = 1;
+        order_of_sectors [i] = s;
+    }
+    fprintf(mfm_err, "Track %d/%d: %d sectors per track\n",
+        t >> 1, t & 1, nsectors_per_track);
+    if (nsectors_per_track < 1)
+        return 0;
+
+    fprintf(mfm_err, "Order of sectors:");
+    for (s=0; s<i; ++s) {
+        fprintf(mfm_err, " %d", order_of_sectors[s] + 1);
+    }
+    fprintf(mfm_err, "\n");
 
-        fprintf(mfm_err, "Sector gap:");
-        for (s=0; s<i; ++s) {
-            fprintf(mfm_err, " %d", sector_gap[s] - 15*8);
-        }
-        fprintf(mfm_err, " bits (std %d)\n",
-            (nsectors_per_track == 10) ? 46*8 : 80*8);
+    fprintf(mfm_err, "Sector gap:");
+    for (s=0; s<i; ++s) {
+        fprintf(mfm_err, " %d", sector_gap[s] - 15*8);
+    }
+    fprintf(mfm_err, " bits (std %d)\n",
+        (nsectors_per_track == 10) ? 46*8 : 80*8);
 
-        fprintf(mfm_err, "Data gap:");
-        for (s=0; s<i; ++s) {
-            fprintf(mfm_err, " %d", data_gap[s] - 15*8);
-        }
-        fprintf(mfm_err, " bits (std %d)\n", 22*8);
+    fprintf(mfm_err, "Data gap:");
+    for (s=0; s<i; ++s) {
+        fprintf(mfm_err, " %d", data_gap[s] - 15*8);
+    }
+    fprintf(mfm_err, " bits (std %d)\n", 22*8);
 
-        /* Проверим, что получили все сектора. */
-        for (s=0; s<nsectors_per_track; ++s) {
-            if (! have_sector [s])
-                fprintf(mfm_err, "No sector %d\n", s + 1);
+    /* Проверим, что получили все сектора. */
+    for (s=0; s<nsectors_per_track; ++s) {
+        if (! have_sector [s]) {
+            mfm_stat_add(MFM_STAT_MISSING, 1);
+            fprintf(mfm_err, "No sector %d\n", s + 1);
         }
     }
+    return 0;
+}
+
+/*
+ * Исследуем и печатаем информацию о дискете IBM PC из MFM-файла.
+ * Количество дорожек (до 160) задаётся параметром ntracks.
+ */
+void mfm_analyze_ibmpc(mfm_image_t *img, int ntracks)
+{
+    fprintf(mfm_err, "Format: IBM PC\n");
+    if (mfm_for_each_track(img, 0, ntracks, analyze_track_ibmpc, 0) < 0)
+        exit(-1);
 }
 
 /*
  * Записываем идентификатор и его контрольную сумму.
  */
-static void write_ident(mfm_writer_t *writer, int t, int s)
+static void write_ident(mfm_writer_t *writer, int t, int s, int size)
 {
     int sum;
 
     mfm_write_byte(writer, t >> 1);
     mfm_write_byte(writer, t & 1);
     mfm_write_byte(writer, s + 1);
-    mfm_write_byte(writer, 2);
+    mfm_write_byte(writer, size);
 
-    sum = crc16_ccitt_byte(0xb230, t >> 1);
-    sum = crc16_ccitt_byte(sum, t & 1);
-    sum = crc16_ccitt_byte(sum, s + 1);
-    sum = crc16_ccitt_byte(sum, 2);
+    sum = mfm_crc16_byte(0xb230, t >> 1);
+    sum = mfm_crc16_byte(sum, t & 1);
+    sum = mfm_crc16_byte(sum, s + 1);
+    sum = mfm_crc16_byte(sum, size);
 
     mfm_write_byte(writer, sum >> 8);
     mfm_write_byte(writer, sum);
@@ -434,41 +582,183 @@ static void write_marker(mfm_writer_t *writer)
     }
 }
 
+typedef struct {
+    mfm_disk_t *disk;
+    int skip_index_mark;
+    mfm_template_t *tpl;        /* шаблон дорожки, или 0 */
+    mfm_template_t *build;      /* строящийся шаблон, или 0 */
+} write_args_t;
+
+/*
+ * Записываем одну дорожку в формате IBM PC.
+ * При построении шаблона данные секторов нулевые,
+ * а начало каждого поля отмечается в шаблоне.
+ */
+static void encode_track_ibmpc(mfm_writer_t *writer, int t, write_args_t *args)
+{
+    static const unsigned char zero [MAXSECTSZ];
+    mfm_disk_t *d = args->disk;
+    const unsigned char *data;
+    int s, sum, size;
+
+    if (! args->skip_index_mark) {
+        mfm_write_gap(writer, 80, mfm_gap_byte);
+        write_index_marker(writer);
+        mfm_write_byte(writer, 0xfc);
+    }
+    mfm_write_gap(writer, mfm_index_gap, mfm_gap_byte);
+    for (s=0; s<d->nsectors_per_track; ++s) {
+        if (s > 0)
+            mfm_write_gap(writer, mfm_sector_gap, mfm_gap_byte);
+        /* Сектор не может быть больше своей ячейки.
+         * Шаблон строим для дорожки из одинаковых полных
+         * секторов, независимо от дорожки t. */
+        size = args->build ? d->size : d->track[t].size[s];
+        if (size > d->size)
+            size = d->size;
+        data = args->build ? zero : mfm_disk_sector(d, t, s);
+
+        write_marker(writer);
+        mfm_write_byte(writer, 0xfe);
+        mfm_template_field(args->build, writer, 6);
+        write_ident(writer, t, s, size);
+        mfm_write_gap(writer, mfm_data_gap, mfm_gap_byte);
+        write_marker(writer);
+        mfm_write_byte(writer, 0xfb);
+        mfm_template_field(args->build, writer, (128 << size) + 2);
+        mfm_write(writer, (unsigned char*) data, 128 << size);
+
+        sum = mfm_crc16_byte(0xcdb4, 0xfb);
+        sum = mfm_crc16_ccitt(sum, data, 128 << size);
+        mfm_write_byte(writer, sum >> 8);
+        mfm_write_byte(writer, sum);
+    }
+    mfm_fill_track(writer, mfm_gap_byte);
+}
+
+/*
+ * Длина дорожки формата IBM PC в байтах данных, с маркером индекса,
+ * но без заполнения в конце: nsectors секторов по 128 << size байт.
+ * Зазоры берём текущие, а пока они не заданы - по умолчанию.
+ * На дорожку помещается TRACKSZ / 2 байт.
+ */
+int mfm_ibmpc_track_bytes(int nsectors, int size)
+{
+    int index_gap, sector_gap, data_gap;
+
+    index_gap = mfm_index_gap ? mfm_index_gap : INDEX_GAP;
+    data_gap = mfm_data_gap ? mfm_data_gap : DATA_GAP;
+    sector_gap = mfm_sector_gap ? mfm_sector_gap :
+        (nsectors == 10) ? SECTOR_GAP_10 : SECTOR_GAP_9;
+
+    /* Зазор 80, маркер индекса и FC; маркер, FE, идентификатор,
+     * зазор, маркер, FB, данные и контрольная сумма. */
+    return 80 + 16 + index_gap +
+        nsectors * (16 + 6 + data_gap + 16 + (128 << size) + 2) +
+        (nsectors - 1) * sector_gap;
+}
+
+/*
+ * Дорожка по шаблону: кодируются только идентификаторы
+ * и данные с контрольными суммами. Нулевые сектора
+ * уже есть в шаблоне.
+ */
+static void splice_track_ibmpc(mfm_writer_t *writer, int t, write_args_t *args)
+{
+    unsigned char field [MAXSECTSZ + 2];
+    mfm_disk_t *d = args->disk;
+    const unsigned char *data;
+    int s, sum, nbytes = d->sector_bytes;
+
+    mfm_template_begin(writer, args->tpl);
+    for (s=0; s<d->nsectors_per_track; ++s) {
+        field[0] = t >> 1;
+        field[1] = t & 1;
+        field[2] = s + 1;
+        field[3] = d->size;
+        sum = mfm_crc16_byte(0xb230, field[0]);
+        sum = mfm_crc16_byte(sum, field[1]);
+        sum = mfm_crc16_byte(sum, field[2]);
+        sum = mfm_crc16_byte(sum, field[3]);
+        field[4] = sum >> 8;
+        field[5] = sum;
+        mfm_template_splice(writer, args->tpl, 2*s, field);
+
+        data = mfm_disk_sector(d, t, s);
+        if (mfm_is_zero(data, nbytes))
+            continue;
+        memcpy(field, data, nbytes);
+        sum = mfm_crc16_byte(0xcdb4, 0xfb);
+        sum = mfm_crc16_ccitt(sum, data, nbytes);
+        field[nbytes] = sum >> 8;
+        field[nbytes + 1] = sum;
+        mfm_template_splice(writer, args->tpl, 2*s + 1, field);
+    }
+    mfm_template_end(writer);
+}
+
+static void write_track_ibmpc(mfm_writer_t *writer, int t, void *arg)
+{
+    write_args_t *args = arg;
+    mfm_track_t *tr = &args->disk->track[t];
+    int s;
+
+    /* Шаблон годится, если все сектора во всю ячейку. */
+    if (args->tpl) {
+        for (s=0; s<args->disk->nsectors_per_track; ++s)
+            if (tr->size[s] != args->disk->size)
+                break;
+        if (s == args->disk->nsectors_per_track) {
+            splice_track_ibmpc(writer, t, args);
+            return;
+        }
+    }
+    encode_track_ibmpc(writer, t, args);
+}
+
+/*
+ * Шаблон дорожки для геометрии диска и текущих зазоров.
+ */
+static mfm_template_t *template_ibmpc(write_args_t *args)
+{
+    mfm_disk_t *d = args->disk;
+    mfm_writer_t writer;
+    mfm_template_t *tpl;
+    int key [MFM_TEMPLATE_KEY];
+
+    key[0] = 1;                 /* IBM PC */
+    key[1] = args->skip_index_mark;
+    key[2] = d->nsectors_per_track;
+    key[3] = d->size;
+    key[4] = mfm_index_gap;
+    key[5] = mfm_sector_gap;
+    key[6] = mfm_data_gap;
+    key[7] = mfm_gap_byte;
+    tpl = mfm_template_find(key);
+    if (! tpl) {
+        args->build = mfm_template_new(key);
+        mfm_write_reset(&writer, 0);
+        encode_track_ibmpc(&writer, 0, args);
+        tpl = mfm_template_done(args->build, &writer);
+        args->build = 0;
+    }
+    return tpl->valid ? tpl : 0;
+}
+
 /*
  * Записываем MFM-образ флоппи-диска в формате IBM PC.
  */
 void mfm_write_ibmpc(mfm_disk_t *d, FILE *fout, int skip_index_mark)
 {
-    mfm_writer_t writer;
-    int t, s, sum;
+    write_args_t args;
 
     if (mfm_verbose)
         fprintf(mfm_err, "Creating %d tracks, %d sectors per track\n",
             d->ntracks, d->nsectors_per_track);
-    for (t=0; t<d->ntracks; ++t) {
-        mfm_write_reset(&writer, fout);
-        if (! skip_index_mark) {
-            mfm_write_gap(&writer, 80, mfm_gap_byte);
-            write_index_marker(&writer);
-            mfm_write_byte(&writer, 0xfc);
-        }
-        mfm_write_gap(&writer, mfm_index_gap, mfm_gap_byte);
-        for (s=0; s<d->nsectors_per_track; ++s) {
-            if (s > 0)
-                mfm_write_gap(&writer, mfm_sector_gap, mfm_gap_byte);
-            write_marker(&writer);
-            mfm_write_byte(&writer, 0xfe);
-            write_ident(&writer, t, s);
-            mfm_write_gap(&writer, mfm_data_gap, mfm_gap_byte);
-            write_marker(&writer);
-            mfm_write_byte(&writer, 0xfb);
-            mfm_write(&writer, d->block[t][s], SECTSZ);
-
-            sum = crc16_ccitt_byte(0xcdb4, 0xfb);
-            sum = crc16_ccitt(sum, d->block[t][s], SECTSZ);
-            mfm_write_byte(&writer, sum >> 8);
-            mfm_write_byte(&writer, sum);
-        }
-        mfm_fill_track(&writer, mfm_gap_byte);
-    }
+    args.disk = d;
+    args.skip_index_mark = skip_index_mark;
+    args.build = 0;
+    args.tpl = 0;
+    args.tpl = template_ibmpc(&args);
+    mfm_write_disk(fout, d, write_track_ibmpc, &args);
 }
@@ -0,0 +1,505 @@
+/*
+ * Sector index of an MFM image and direct access to sectors.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "mfm.h"
+
+#ifdef __APPLE__
+#   define st_mtim st_mtimespec
+#endif
+
+#define INDEX_MAGIC     "MFMIDX1"
+#define TRACK_ENTRIES   64      /* ID marks kept per track */
+
+/*
+ * Sidecar file: this header, then first[ntracks + 1]
+ * and the entries, all in host byte order.  A file written
+ * on another machine fails the key check and is rebuilt.
+ */
+typedef struct {
+    char magic [8];
+    uint64_t image_size;
+    int64_t image_mtime;
+    int64_t image_mtime_nsec;
+    uint64_t image_hash;
+    uint32_t ntracks;
+    uint32_t nentries;
+} header_t;
+
+/*
+ * Entries of one track, collected by the index pass.
+ */
+typedef struct {
+    int present;                /* the track is in the image */
+    int n;
+    mfm_index_entry_t e [TRACK_ENTRIES];
+} track_entries_t;
+
+/*
+ * Record every ID mark of the track: the position of the ID field,
+ * C/H/R/N, and the position and CRC status of the data field.
+ * The marks are found the same way mfm_read_sector_ibmpc() does.
+ */
+static void scan_track(mfm_reader_t *reader, track_entries_t *te)
+{
+    unsigned char scratch [MAXSECTSZ];
+    mfm_index_entry_t *e;
+    unsigned short sum, my_sum;
+    int tag, gap, size;
+
+    te->present = (reader->nbytes > 0);
+    te->n = 0;
+    tag = mfm_scan_ibmpc(reader, &gap);
+    while (tag >= 0 && te->n < TRACK_ENTRIES) {
+        if (tag != 0xfe) {
+            tag = mfm_scan_ibmpc(reader, &gap);
+            continue;
+        }
+        e = &te->e[te->n++];
+        memset(e, 0, sizeof(*e));
+        e->id_halfbit = reader->halfbit;
+        e->data_halfbit = -1;
+        e->cylinder = mfm_read_byte(reader);
+        e->head = mfm_read_byte(reader);
+        e->sector = mfm_read_byte(reader);
+        e->size = mfm_read_byte(reader);
+        sum = mfm_read_byte(reader) << 8;
+        sum |= mfm_read_byte(reader);
+
+        my_sum = mfm_crc16_byte(0xb230, e->cylinder);
+        my_sum = mfm_crc16_byte(my_sum, e->head);
+        my_sum = mfm_crc16_byte(my_sum, e->sector);
+        my_sum = mfm_crc16_byte(my_sum, e->size);
+        if (my_sum != sum) {
+            e->flags = MFM_INDEX_BAD_ID | MFM_INDEX_NO_DATA;
+            tag = mfm_scan_ibmpc(reader, &gap);
+            continue;
+        }
+
+        /* A second ID mark means the data field is missing. */
+        tag = mfm_scan_ibmpc(reader, &gap);
+        if (tag < 0 || tag == 0xfe) {
+            e->flags = MFM_INDEX_NO_DATA;
+            continue;
+        }
+        size = (e->size > MAXSIZE) ? 2 : e->size;
+        e->tag = tag;
+        e->data_halfbit = reader->halfbit;
+        my_sum = mfm_crc16_byte(0xcdb4, tag);
+        my_sum = mfm_read_bytes_crc(reader, scratch, 128 << size, my_sum);
+        sum = mfm_read_byte(reader) << 8;
+        sum |= mfm_read_byte(reader);
+        if (my_sum != sum)
+            e->flags = MFM_INDEX_BAD_DATA;
+        tag = mfm_scan_ibmpc(reader, &gap);
+    }
+}
+
+static int index_track(mfm_reader_t *reader, void *arg)
+{
+    track_entries_t *te = (track_entries_t*) arg + reader->track;
+
+    scan_track(reader, te);
+    return reader->nbytes < TRACKSZ;
+}
+
+/*
+ * Index pass over the whole image.
+ */
+static void build(mfm_index_t *idx, mfm_image_t *img)
+{
+    track_entries_t *tracks;
+    int t, n;
+
+    tracks = calloc(MAXTRACK, sizeof(track_entries_t));
+    if (! tracks) {
+        fprintf(stderr, "Out of memory, aborted.\n");
+        exit(-1);
+    }
+    mfm_for_each_track(img, 0, MAXTRACK, index_track, tracks);
+
+    idx->ntracks = 0;
+    n = 0;
+    for (t=0; t<MAXTRACK; ++t) {
+        if (tracks[t].present)
+            idx->ntracks = t + 1;
+        n += tracks[t].n;
+    }
+    idx->entry = malloc(n * sizeof(mfm_index_entry_t) + 1);
+    if (! idx->entry) {
+        fprintf(stderr, "Out of memory, aborted.\n");
+        exit(-1);
+    }
+    n = 0;
+    for (t=0; t<MAXTRACK; ++t) {
+        idx->first[t] = n;
+        memcpy(idx->entry + n, tracks[t].e, tracks[t].n * sizeof(mfm_index_entry_t));
+        n += tracks[t].n;
+    }
+    idx->first[MAXTRACK] = n;
+    free(tracks);
+}
+
+/*
+ * FNV-1a hash of 64 bytes from the middle of every track.
+ * With the size and mtime it tells a rewritten image from the
+ * indexed one without reading the whole file.
+ */
+static uint64_t sample_hash(const unsigned char *map, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t offset;
+    int i;
+
+    for (offset=TRACKSZ/2; offset+64<=size; offset+=TRACKSZ) {
+        for (i=0; i<64; ++i) {
+            hash ^= map[offset + i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+/*
+ * Fill the key of the index from the size, mtime and contents
+ * of the mapped image.
+ */
+static int image_key(mfm_index_t *idx, mfm_image_t *img)
+{
+    struct stat st;
+
+    if (! img->map || fstat(fileno(img->fd), &st) < 0)
+        return -1;
+    idx->image_size = st.st_size;
+    idx->image_mtime = st.st_mtim.tv_sec;
+    idx->image_mtime_nsec = st.st_mtim.tv_nsec;
+    idx->image_hash = sample_hash(img->map, img->size);
+    return 0;
+}
+
+/*
+ * Read the sidecar file.  Fails when it is absent, damaged
+ * or made for another version of the image.
+ */
+static int load(mfm_index_t *idx, const char *path)
+{
+    header_t h;
+    uint32_t first [MAXTRACK + 1];
+    FILE *f;
+    int t, ok;
+
+    f = fopen(path, "rb");
+    if (! f)
+        return -1;
+    ok = fread(&h, sizeof(h), 1, f) == 1 &&
+        memcmp(h.magic, INDEX_MAGIC, 8) == 0 &&
+        h.image_size == idx->image_size &&
+        h.image_mtime == idx->image_mtime &&
+        h.image_mtime_nsec == idx->image_mtime_nsec &&
+        h.image_hash == idx->image_hash &&
+        h.ntracks <= MAXTRACK &&
+        h.nentries <= MAXTRACK * TRACK_ENTRIES &&
+        fread(first, sizeof(first[0]), h.ntracks + 1, f) == h.ntracks + 1 &&
+        first[0] == 0 && first[h.ntracks] == h.nentries;
+    for (t=0; ok && t<(int)h.ntracks; ++t)
+        if (first[t] > first[t+1])
+            ok = 0;
+    if (ok) {
+        idx->entry = malloc(h.nentries * sizeof(mfm_index_entry_t) + 1);
+        ok = idx->entry &&
+            fread(idx->entry, sizeof(mfm_index_entry_t), h.nentries, f) == h.nentries &&
+            getc(f) == EOF;
+    }
+    fclose(f);
+    if (! ok) {
+        free(idx->entry);
+        idx->entry = 0;
+        return -1;
+    }
+    idx->ntracks = h.ntracks;
+    for (t=0; t<=MAXTRACK; ++t)
+        idx->first[t] = (t <= idx->ntracks) ? first[t] : h.nentries;
+    return 0;
+}
+
+/*
+ * Write the sidecar file through a temporary name, so that
+ * a concurrent reader sees either the old or the new index.
+ * A read-only directory just leaves the image without one.
+ */
+static void save(mfm_index_t *idx, const char *path)
+{
+    header_t h;
+    char *tmp;
+    FILE *f;
+    int ok;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.image_size = idx->image_size;
+    h.image_mtime = idx->image_mtime;
+    h.image_mtime_nsec = idx->image_mtime_nsec;
+    h.image_hash = idx->image_hash;
+    h.ntracks = idx->ntracks;
+    h.nentries = idx->first[idx->ntracks];
+
+    tmp = malloc(strlen(path) + 16);
+    if (! tmp)
+        return;
+    sprintf(tmp, "%s.%d", path, (int) getpid());
+    f = fopen(tmp, "wb");
+    if (! f) {
+        if (mfm_verbose)
+            perror(tmp);
+        free(tmp);
+        return;
+    }
+    ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+        fwrite(idx->first, sizeof(idx->first[0]), h.ntracks + 1, f) == h.ntracks + 1 &&
+        fwrite(idx->entry, sizeof(mfm_index_entry_t), h.nentries, f) == h.nentries;
+    if (fclose(f) != 0)
+        ok = 0;
+    if (! ok || rename(tmp, path) < 0) {
+        if (mfm_verbose)
+            perror(path);
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+/*
+ * Get the sector index of an IBM PC image.  When filename is given,
+ * the index is kept next to the image in filename.idx: a matching
+ * sidecar is loaded, otherwise the index is built and saved there.
+ * The image must be mapped: sectors are read by seeking back into
+ * it, and a pipe is gone once the index pass has read it.
+ */
+mfm_index_t *mfm_index_open(mfm_image_t *img, const char *filename)
+{
+    mfm_index_t *idx;
+
+    if (! img->map) {
+        fprintf(stderr, "Sector access needs an image file, not a pipe, aborted.\n");
+        exit(-1);
+    }
+    idx = calloc(1, sizeof(mfm_index_t));
+    if (! idx) {
+        fprintf(stderr, "Out of memory, aborted.\n");
+        exit(-1);
+    }
+    if (filename && image_key(idx, img) == 0) {
+        idx->sidecar = malloc(strlen(filename) + 5);
+        if (idx->sidecar) {
+            sprintf(idx->sidecar, "%s.idx", filename);
+            if (load(idx, idx->sidecar) == 0)
+                return idx;
+        }
+    }
+    build(idx, img);
+    if (idx->sidecar)
+        save(idx, idx->sidecar);
+    return idx;
+}
+
+void mfm_index_free(mfm_index_t *idx)
+{
+    free(idx->sidecar);
+    free(idx->entry);
+    free(idx);
+}
+
+/*
+ * Check that the ID field is still where the index says.
+ */
+static int check_id(mfm_reader_t *reader, const mfm_index_entry_t *e)
+{
+    if (e->id_halfbit < 0 || e->data_halfbit < 16)
+        return 0;
+    reader->halfbit = e->id_halfbit;
+    if (mfm_read_byte(reader) != e->cylinder ||
+        mfm_read_byte(reader) != e->head ||
+        mfm_read_byte(reader) != e->sector ||
+        mfm_read_byte(reader) != e->size)
+        return 0;
+    reader->halfbit = e->data_halfbit - 16;
+    return mfm_read_byte(reader) == e->tag;
+}
+
+/*
+ * Find sector number `sector' on physical track cylinder/head and
+ * load the track into the reader.  As on a full track read, the
+ * last copy of a repeated sector wins; C/H of the ID field are
+ * not compared.  Return 0 when there is no such sector.
+ */
+static mfm_index_entry_t *locate(mfm_index_t *idx, mfm_image_t *img,
+    mfm_reader_t *reader, int cylinder, int head, int sector)
+{
+    mfm_index_entry_t *e, *found = 0;
+    int t = cylinder * 2 + head;
+
+    if (cylinder < 0 || head < 0 || head > 1 || t >= idx->ntracks)
+        return 0;
+    for (e = idx->entry + idx->first[t]; e < idx->entry + idx->first[t+1]; ++e)
+        if (e->sector == sector && ! (e->flags & (MFM_INDEX_BAD_ID | MFM_INDEX_NO_DATA)))
+            found = e;
+    if (! found)
+        return 0;
+
+    mfm_read_seek(reader, img, t);
+    if (! check_id(reader, found)) {
+        fprintf(mfm_err, "Track %d/%d: sector index is out of date\n",
+            cylinder, head);
+        return 0;
+    }
+    return found;
+}
+
+/*
+ * Read a sector, seeking straight to its data field.
+ * Return the size code and the CRC status in bad_crc,
+ * or -1 when there is no such sector.
+ */
+int mfm_index_read_sector(mfm_index_t *idx, mfm_image_t *img,
+    int cylinder, int head, int sector, unsigned char *data, int *bad_crc)
+{
+    const mfm_index_entry_t *found;
+    mfm_reader_t reader;
+    unsigned short sum, my_sum;
+    int t = cylinder * 2 + head, size;
+
+    found = locate(idx, img, &reader, cylinder, head, sector);
+    if (! found)
+        return -1;
+    size = (found->size > MAXSIZE) ? 2 : found->size;
+    my_sum = mfm_crc16_byte(0xcdb4, found->tag);
+    my_sum = mfm_read_bytes_crc(&reader, data, 128 << size, my_sum);
+    sum = mfm_read_byte(&reader) << 8;
+    sum |= mfm_read_byte(&reader);
+    if (my_sum != sum)
+        mfm_stat_add(MFM_STAT_DATA_CRC, 1);
+    if (bad_crc)
+        *bad_crc = (my_sum != sum);
+    MFM_TRACE(MFM_EV_SECTOR, t, sector - 1, my_sum != sum);
+    return size;
+}
+
+/*
+ * Replace the data of a sector in the image file, which must be
+ * mapped and open for writing.  Only the data field and its CRC
+ * are encoded again: the first clock bit follows the last bit of
+ * the data mark, and the clock bit of the cell after the CRC is
+ * fixed up for the new last bit.  The touched bytes are written
+ * back with one pwrite(); the gaps and all other fields stay as
+ * they are.  Return the size code, or -1 on error.
+ */
+int mfm_index_write_sector(mfm_index_t *idx, mfm_image_t *img,
+    int cylinder, int head, int sector, const unsigned char *data, int nbytes)
+{
+    unsigned char field [2 + MAXSECTSZ + 2], enc [2 * sizeof(field)];
+    unsigned char buf [2 * sizeof(field) + 2];
+    mfm_index_entry_t *found;
+    mfm_reader_t reader;
+    unsigned short sum;
+    int t = cylinder * 2 + head, size, start, end, first, last, shift, span;
+    int i, bit, next;
+    uint64_t t0;
+    off_t offset;
+
+    if (! img->map) {
+        fprintf(mfm_err, "Cannot rewrite sectors of a non-regular file\n");
+        return -1;
+    }
+    found = locate(idx, img, &reader, cylinder, head, sector);
+    if (! found)
+        return -1;
+    size = (found->size > MAXSIZE) ? 2 : found->size;
+    if (nbytes != 128 << size) {
+        fprintf(mfm_err, "Track %d/%d sector %d: %d bytes, expected %d\n",
+            cylinder, head, sector, nbytes, 128 << size);
+        return -1;
+    }
+    start = found->data_halfbit;
+    end = start + 16 * (nbytes + 2);
+    if (end > reader.nhalfbits) {
+        fprintf(mfm_err, "Track %d/%d sector %d: data field crosses the end of track\n",
+            cylinder, head, sector);
+        return -1;
+    }
+
+    /* Data and CRC, encoded after the last bit of the data mark. */
+    memcpy(field, data, nbytes);
+    sum = mfm_crc16_byte(0xcdb4, found->tag);
+    sum = mfm_crc16_ccitt(sum, data, nbytes);
+    field[nbytes] = sum >> 8;
+    field[nbytes + 1] = sum;
+    bit = reader.data[(start - 1) >> 3] >> (7 - ((start - 1) & 7)) & 1;
+    last = mfm_encode(enc, field, nbytes + 2, bit);
+
+    /* Splice it into a copy of the touched bytes at any bit offset. */
+    first = start >> 3;
+    shift = start & 7;
+    span = ((end < reader.nhalfbits ? end + 1 : end) + 7) / 8 - first;
+    memcpy(buf, reader.data + first, span);
+    for (i=0; i<2*(nbytes+2); ++i) {
+        if (shift == 0) {
+            buf[i] = enc[i];
+            continue;
+        }
+        buf[i] = (buf[i] & ~(0xff >> shift)) | enc[i] >> shift;
+        buf[i+1] = (buf[i+1] & (0xff >> shift)) | enc[i] << (8 - shift);
+    }
+
+    /* Clock bit of the next cell: 1 only between two zeros. */
+    if (end + 1 < reader.nhalfbits) {
+        next = reader.data[(end + 1) >> 3] >> (7 - ((end + 1) & 7)) & 1;
+        i = end - 8*first;
+        if (! last && ! next)
+            buf[i >> 3] |= 0x80 >> (i & 7);
+        else
+            buf[i >> 3] &= ~(0x80 >> (i & 7));
+    }
+
+    offset = (off_t) t * TRACKSZ + first;
+    t0 = MFM_TRACE_CLOCK();
+    if (pwrite(fileno(img->fd), buf, span, offset) != span) {
+        perror("pwrite");
+        return -1;
+    }
+    MFM_TRACE_IO(MFM_EV_WRITE, t, span, t0);
+    mfm_stat_add(MFM_STAT_BYTES_WRITTEN, span);
+    found->flags &= ~MFM_INDEX_BAD_DATA;
+
+    /* The offsets are still valid: refresh the key of the sidecar. */
+    if (idx->sidecar && image_key(idx, img) == 0)
+        save(idx, idx->sidecar);
+    return size;
+}
@@ -0,0 +1,589 @@
+/*
+ * Microbenchmarks of the hot MFM kernels.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include "config.h"
+#include "mfm.h"
+#include "scp.h"
+
+#ifdef __linux__
+#   include <sys/ioctl.h>
+#   include <sys/syscall.h>
+#   include <linux/perf_event.h>
+#   define HAVE_PERF_EVENTS 1
+#endif
+
+#define SCP_TICKS   80          /* 25-ns ticks per halfbit at 250 kbit/s */
+
+static int nreps = 5;           /* best of this many measurements */
+static double min_time = 0.02;  /* seconds per measurement */
+static const char *only;        /* run only kernels with this prefix */
+static int check_only;          /* run the self-checks and exit */
+
+static volatile unsigned long sink;
+
+/*
+ * Test data: one track of random bytes, the same track
+ * in MFM encoding, and its flux samples with some jitter.
+ */
+static unsigned char data [TRACKSZ / 2];
+static unsigned char track [TRACKSZ];
+static uint16_t flux [TRACKSZ * 8];
+static int nflux;
+static scp_file_t sf;
+
+static void usage()
+{
+    fprintf(stderr, "Microbenchmarks of mfmdisk kernels, version %s\n", PACKAGE_VERSION);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "    mfmkbench [options] [kernel-prefix]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -c         run the self-checks of all kernels and exit\n");
+    fprintf(stderr, "    -n N       best of N measurements, default %d\n", nreps);
+    fprintf(stderr, "    -t MSEC    duration of one measurement, default %.0f\n", min_time * 1000);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Results are printed as one JSON object per line.\n");
+    exit(-1);
+}
+
+static void setup()
+{
+    uint32_t x = 12345;
+    unsigned char *p;
+    int i, cnt, val;
+
+    for (i=0; i<(int)sizeof(data); ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = x;
+    }
+    mfm_encode(track, data, sizeof(data), 0);
+
+    nflux = 0;
+    cnt = 0;
+    for (i=0; i<TRACKSZ*8; ++i) {
+        cnt++;
+        if (track[i/8] >> (7 - i%8) & 1) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            val = cnt * SCP_TICKS + (int) (x % 9) - 4;
+
+            /* Samples are big-endian. */
+            p = (unsigned char*) &flux[nflux++];
+            p[0] = val >> 8;
+            p[1] = val;
+            cnt = 0;
+        }
+    }
+    memset(&sf, 0, sizeof(sf));
+    sf.dat = flux;
+    sf.datsz = nflux;
+    sf.index_ptr[0] = nflux;
+}
+
+static const char *crc_kernels[] = { "pclmul", "slice16", "slice8", "table" };
+
+#define NCRC (sizeof(crc_kernels) / sizeof(crc_kernels[0]))
+
+/*
+ * Every checksum kernel must give the same sums as the reference
+ * table, for any length, alignment and initial value.
+ */
+static void check_crc()
+{
+    static const unsigned short init[] = { 0xffff, 0xcdb4, 0 };
+    static unsigned char out [1200], expect [1200];
+    mfm_reader_t reader;
+    unsigned short ref, sum;
+    unsigned i, k, len, off;
+
+    for (k=0; k<NCRC; ++k) {
+        if (mfm_crc_select(crc_kernels[k]) < 0)
+            continue;
+        for (len=0; len<=1100; ++len) {
+            for (off=0; off<8; ++off) {
+                for (i=0; i<sizeof(init)/sizeof(init[0]); ++i) {
+                    mfm_crc_select("table");
+                    ref = mfm_crc16_ccitt(init[i], data + off, len);
+                    mfm_crc_select(crc_kernels[k]);
+                    sum = mfm_crc16_ccitt(init[i], data + off, len);
+                    if (sum != ref) {
+                        fprintf(stderr, "crc16 %s: length %u, offset %u, init %04x: "
+                            "sum %04x, expected %04x\n", crc_kernels[k],
+                            len, off, init[i], sum, ref);
+                        exit(1);
+                    }
+                }
+            }
+        }
+        for (off=0; off<64; off+=3) {
+            len = 1100 + off;
+            ref = mfm_crc16_ccitt(0xffff, data + off, len);
+            sum = mfm_crc16_mfm(0xffff, track, 16*off, len);
+            if (sum != ref) {
+                fprintf(stderr, "crc16_mfm %s: offset %u: sum %04x, expected %04x\n",
+                    crc_kernels[k], off, sum, ref);
+                exit(1);
+            }
+
+            /* The fused reader, with the track ending in the field. */
+            reader.data = track;
+            reader.nbytes = TRACKSZ;
+            reader.nhalfbits = 16 * (off + len - off % 5);
+            reader.halfbit = 16 * off;
+            memset(out, 0xaa, sizeof(out));
+            sum = mfm_read_bytes_crc(&reader, out, len, 0xffff);
+            memset(expect, 0, sizeof(expect));
+            memcpy(expect, data + off, len - off % 5);
+            ref = mfm_crc16_ccitt(0xffff, expect, len);
+            if (sum != ref || memcmp(out, expect, len) != 0) {
+                fprintf(stderr, "read_bytes_crc %s: offset %u: sum %04x, expected %04x\n",
+                    crc_kernels[k], off, sum, ref);
+                exit(1);
+            }
+        }
+    }
+    mfm_crc_select(0);
+}
+
+static const char *decoders[] = { "bmi2", "avx2", "sse2", "scalar" };
+
+#define NDECODE (sizeof(decoders) / sizeof(decoders[0]))
+
+/*
+ * Every decoding kernel the CPU supports must give the same bytes
+ * as the scalar reference, for any halfbit offset and length,
+ * and must not write past the end of the output.
+ */
+static void check_decode()
+{
+    static unsigned char out [1200], expect [1200];
+    unsigned k, len, halfbit;
+
+    for (k=0; k<NDECODE; ++k) {
+        if (mfm_decode_select(decoders[k]) < 0)
+            continue;
+        for (halfbit=0; halfbit<256; ++halfbit) {
+            for (len=0; len<=1100; len += (len < 80) ? 1 : 37) {
+                memset(out, 0xaa, sizeof(out));
+                memset(expect, 0xaa, sizeof(expect));
+                mfm_decode_scalar(expect, track, halfbit, len);
+                mfm_decode(out, track, halfbit, len);
+                if (memcmp(out, expect, sizeof(out)) != 0) {
+                    fprintf(stderr, "decode %s: halfbit %u, length %u: "
+                        "wrong data\n", decoders[k], halfbit, len);
+                    exit(1);
+                }
+            }
+        }
+    }
+    mfm_decode_select(0);
+}
+
+/*
+ * A sector mark must be found when one of its sync words has
+ * a damaged clock bit (0x4689 still decodes to A1), in both
+ * halfbit phases and at any verbosity.  The mark is 12 zeros,
+ * three A1 and FE for IBM PC, or two A1 and FF for Amiga.
+ */
+static void check_sync()
+{
+    static unsigned char bytes [64], raw [2*sizeof(bytes) + 1];
+    mfm_reader_t reader;
+    FILE *null;
+    int amiga, nsync, flip, phase, verbose, word, tag, end, i;
+
+    null = fopen("/dev/null", "w");
+    if (! null) {
+        perror("/dev/null");
+        exit(1);
+    }
+    for (amiga=0; amiga<2; ++amiga) {
+        nsync = amiga ? 2 : 3;
+        memset(bytes, 0x4e, sizeof(bytes));
+        memset(bytes + 40, 0, 12);
+        memset(bytes + 52, 0xa1, nsync);
+        bytes[52 + nsync] = amiga ? 0xff : 0xfe;
+
+        for (flip=-1; flip<nsync; ++flip) {
+            for (phase=0; phase<2; ++phase) {
+                memset(raw, 0, sizeof(raw));
+                mfm_encode(raw, bytes, sizeof(bytes), 0);
+                for (i=0; i<nsync; ++i) {
+                    word = (i == flip) ? 0x4689 : MFM_SYNC_A1;
+                    raw[104 + 2*i] = word >> 8;
+                    raw[105 + 2*i] = word;
+                }
+                if (phase) {
+                    for (i=sizeof(raw)-1; i>0; --i)
+                        raw[i] = raw[i] >> 1 | raw[i-1] << 7;
+                    raw[0] >>= 1;
+                }
+
+                /* The scanner stops after the tag. */
+                end = 16 * (53 + nsync) + phase;
+                for (verbose=0; verbose<=2; verbose+=2) {
+                    mfm_verbose = verbose;
+                    mfm_err = null;
+                    reader.data = raw;
+                    reader.nbytes = sizeof(raw);
+                    reader.nhalfbits = 8 * sizeof(raw);
+                    reader.halfbit = 0;
+                    tag = amiga ? mfm_scan_amiga(&reader, 0) :
+                                  mfm_scan_ibmpc(&reader, 0);
+                    mfm_verbose = 0;
+                    mfm_err = stderr;
+                    if (tag != bytes[52 + nsync] || reader.halfbit != end) {
+                        fprintf(stderr, "scan_%s: sync word %d damaged, phase %d, "
+                            "verbose %d: tag %02x at halfbit %d, expected %02x at %d\n",
+                            amiga ? "amiga" : "ibmpc", flip, phase, verbose,
+                            tag, reader.halfbit, bytes[52 + nsync], end);
+                        exit(1);
+                    }
+                }
+            }
+        }
+    }
+    fclose(null);
+}
+
+/*
+ * Kernels.  Each processes one buffer and returns
+ * the number of bytes it consumed or produced.
+ */
+static long run_read_halfbit()
+{
+    mfm_reader_t reader;
+    unsigned long sum = 0;
+    int i;
+
+    reader.data = track;
+    reader.nbytes = TRACKSZ;
+    reader.nhalfbits = TRACKSZ * 8;
+    reader.halfbit = 0;
+    for (i=0; i<TRACKSZ*8; ++i)
+        sum += mfm_read_halfbit(&reader);
+    sink = sum;
+    return TRACKSZ;
+}
+
+static long run_read_byte()
+{
+    mfm_reader_t reader;
+    unsigned long sum = 0;
+    int i;
+
+    reader.data = track;
+    reader.nbytes = TRACKSZ;
+    reader.nhalfbits = TRACKSZ * 8;
+    reader.halfbit = 0;
+    for (i=0; i<TRACKSZ/2; ++i)
+        sum += mfm_read_byte(&reader);
+    sink = sum;
+    return TRACKSZ / 2;
+}
+
+static long run_decode()
+{
+    unsigned char out [TRACKSZ / 2];
+
+    mfm_decode(out, track, 0, sizeof(out) - 1);
+    sink = out[0];
+    return sizeof(out) - 1;
+}
+
+static long run_write_byte()
+{
+    static mfm_writer_t writer;
+    int i;
+
+    mfm_write_reset(&writer, 0);
+    for (i=0; i<TRACKSZ/2; ++i)
+        mfm_write_byte(&writer, data[i]);
+    sink = writer.buf[0];
+    return TRACKSZ / 2;
+}
+
+static long run_crc16()
+{
+    sink = mfm_crc16_ccitt(0xffff, data, SECTSZ);
+    return SECTSZ;
+}
+
+static long run_crc16_mfm()
+{
+    sink = mfm_crc16_mfm(0xffff, track, 0, SECTSZ);
+    return SECTSZ;
+}
+
+static long run_read_bytes_crc()
+{
+    mfm_reader_t reader;
+    unsigned char out [SECTSZ];
+
+    reader.data = track;
+    reader.nbytes = TRACKSZ;
+    reader.nhalfbits = TRACKSZ * 8;
+    reader.halfbit = 0;
+    sink = mfm_read_bytes_crc(&reader, out, SECTSZ, 0xffff) ^ out[0];
+    return SECTSZ;
+}
+
+static long run_shuffle()
+{
+    unsigned char raw [SECTSZ];
+
+    sink = mfm_amiga_shuffle_block(raw, data) ^ raw[0];
+    return SECTSZ;
+}
+
+static long run_unshuffle()
+{
+    unsigned char out [SECTSZ];
+
+    sink = mfm_amiga_unshuffle_block(out, data) ^ out[0];
+    return SECTSZ;
+}
+
+static long run_scp_next_flux()
+{
+    unsigned long sum = 0;
+    int i;
+
+    scp_reset(&sf);
+    for (i=0; i<nflux; ++i)
+        sum += scp_next_flux(&sf, 0);
+    sink = sum;
+    return nflux * sizeof(flux[0]);
+}
+
+static long run_pll_next_bit()
+{
+    unsigned long sum = 0;
+    scp_pll_t pll;
+    int i;
+
+    scp_reset(&sf);
+    scp_pll_init(&pll, &sf, 0);
+    for (i=0; i<TRACKSZ*8; ++i)
+        sum += scp_pll_next_bit(&pll);
+    sink = sum;
+    return TRACKSZ;
+}
+
+#ifdef HAVE_PERF_EVENTS
+/*
+ * Cycles and instructions of this thread in user mode,
+ * counted as one group.  Not available when the kernel
+ * forbids it; then only time is reported.
+ */
+static int perf_fd = -1;
+
+static int perf_open(unsigned long config, int group)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = (group < 0);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void perf_init()
+{
+    perf_fd = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (perf_fd < 0)
+        return;
+    if (perf_open(PERF_COUNT_HW_INSTRUCTIONS, perf_fd) < 0) {
+        close(perf_fd);
+        perf_fd = -1;
+    }
+}
+
+static void perf_start()
+{
+    if (perf_fd < 0)
+        return;
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static int perf_stop(double *cycles, double *instructions)
+{
+    uint64_t val [3];
+
+    if (perf_fd < 0)
+        return 0;
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(perf_fd, val, sizeof(val)) != sizeof(val) || val[0] != 2)
+        return 0;
+    *cycles = val[1];
+    *instructions = val[2];
+    return 1;
+}
+#else
+static void perf_init() {}
+static void perf_start() {}
+static int perf_stop(double *cycles, double *instructions) { return 0; }
+#endif
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Measure one kernel: calibrate the number of iterations
+ * to take at least min_time, then keep the best of nreps runs.
+ */
+static void bench(const char *name, const char *unit, long (*run)(void))
+{
+    double t0, elapsed, best, cycles, instructions, best_cycles, best_instr;
+    long iters, i, nbytes;
+    int r, counted;
+
+    if (only && strncmp(name, only, strlen(only)) != 0)
+        return;
+
+    nbytes = run();
+    for (iters = 1; ; iters *= 2) {
+        t0 = now();
+        for (i=0; i<iters; ++i)
+            run();
+        if (now() - t0 >= min_time)
+            break;
+    }
+
+    best = 0;
+    best_cycles = best_instr = 0;
+    cycles = instructions = 0;
+    counted = 0;
+    for (r=0; r<nreps; ++r) {
+        perf_start();
+        t0 = now();
+        for (i=0; i<iters; ++i)
+            run();
+        elapsed = now() - t0;
+        counted = perf_stop(&cycles, &instructions);
+        if (r == 0 || elapsed < best) {
+            best = elapsed;
+            best_cycles = cycles;
+            best_instr = instructions;
+        }
+    }
+
+    nbytes *= iters;
+    printf("{\"kernel\":\"%s\",\"unit\":\"%s\",\"bytes\":%ld,\"ns_per_byte\":%.4f",
+        name, unit, nbytes, best * 1e9 / nbytes);
+    if (counted)
+        printf(",\"cycles_per_byte\":%.4f,\"instructions_per_byte\":%.4f}\n",
+            best_cycles / nbytes, best_instr / nbytes);
+    else
+        printf(",\"cycles_per_byte\":null,\"instructions_per_byte\":null}\n");
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    char name [32];
+    unsigned i;
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "cn:t:h");
+        if (c < 0)
+            break;
+        switch (c) {
+        case 'c':
+            check_only = 1;
+            break;
+        case 'n':
+            nreps = strtol(optarg, 0, 0);
+            break;
+        case 't':
+            min_time = strtol(optarg, 0, 0) / 1000.0;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind < argc - 1 || nreps < 1 || min_time <= 0)
+        usage();
+    if (optind < argc)
+        only = argv[optind];
+    mfm_err = stderr;
+
+    setup();
+    check_crc();
+    check_decode();
+    check_sync();
+    if (check_only)
+        return 0;
+    perf_init();
+
+    bench("read_halfbit", "raw", run_read_halfbit);
+    bench("read_byte", "data", run_read_byte);
+    for (i=0; i<NDECODE; ++i) {
+        if (mfm_decode_select(decoders[i]) < 0)
+            continue;
+        snprintf(name, sizeof(name), "decode_%s", decoders[i]);
+        bench(name, "data", run_decode);
+    }
+    mfm_decode_select(0);
+    bench("write_byte", "data", run_write_byte);
+    for (i=0; i<NCRC; ++i) {
+        if (mfm_crc_select(crc_kernels[i]) < 0)
+            continue;
+        snprintf(name, sizeof(name), "crc16_%s", crc_kernels[i]);
+        bench(name, "data", run_crc16);
+    }
+    mfm_crc_select(0);
+    bench("crc16_mfm", "data", run_crc16_mfm);
+    bench("read_bytes_crc", "data", run_read_bytes_crc);
+    bench("amiga_shuffle", "data", run_shuffle);
+    bench("amiga_unshuffle", "data", run_unshuffle);
+    bench("scp_next_flux", "flux", run_scp_next_flux);
+    bench("pll_next_bit", "raw", run_pll_next_bit);
+    return 0;
+}
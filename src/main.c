@@ -38,9 +38,28 @@ enum {
     ACTION_EXTRACT,
     ACTION_CREATE,
     ACTION_DUMP,
+    ACTION_SECTOR,
+    ACTION_REWRITE,
+    ACTION_DETECT,
 };
 
-mfm_disk_t disk;
+#define DETECT_TRACKS   8       /* дорожек в выборке для --detect */
+
+mfm_disk_t *disk;
+
+/*
+ * Наибольший код размера сектора, при котором
+ * сектор помещается на дорожку.
+ */
+static int max_sector_size()
+{
+    int size;
+
+    for (size=MAXSIZE; size>0; --size)
+        if (mfm_ibmpc_track_bytes(1, size) <= TRACKSZ / 2)
+            break;
+    return size;
+}
 
 void usage()
 {
@@ -52,20 +71,39 @@ void usage()
     printf("    mfmdisk -x input.mfm output.img\n");
     printf("    mfmdisk -c output.mfm input.img\n");
     printf("    mfmdisk -c [-r N] output.mfm input.scp\n");
+    printf("    mfmdisk -c output.mfm - < input.img\n");
+    printf("    mfmdisk --sector=C/H/R input.mfm output.bin\n");
+    printf("    mfmdisk --write-sector=C/H/R image.mfm input.bin\n");
+    printf("    mfmdisk --detect[=N] input.mfm...\n");
     printf("\n");
 
     printf("Options:\n");
     printf("    -i, --info         show information about MFM file\n");
     printf("    -x, --extract      extract data from MFM file\n");
     printf("    -c, --create       create MFM file\n");
-    printf("    -d, --dump         dump raw bit contents of MFM file\n");
+    printf("    -d, --dump[=hex]   dump raw bit contents of MFM file, or raw bytes in hex\n");
+    printf("    -t N[-M], --tracks=N[-M]\n");
+    printf("                       dump only tracks N...M, 0...%d\n", MAXTRACK-1);
+    printf("    --sector=C/H/R     read one sector through the index input.mfm.idx\n");
+    printf("    --write-sector=C/H/R\n");
+    printf("                       replace the data of one sector in place\n");
+    printf("    --detect[=N]       detect format and geometry from N tracks, default %d\n", DETECT_TRACKS);
     printf("    -v, --verbose      verbose mode\n");
     printf("    -a, --amiga        use Amiga format (default IBM PC)\n");
     printf("    -b, --bk           use BK-0010 format\n");
     printf("    -r N, --revolution=N\n");
     printf("                       decode N-th revolution, default 0\n");
     printf("    -s N, --sectors-per-track=N\n");
-    printf("                       use N sectors per track\n");
+    printf("                       use N sectors per track; for a piped image the\n");
+    printf("                       default geometry comes from its boot sector\n");
+    printf("    -z N, --sector-size=N\n");
+    printf("                       use N bytes per sector, 128...%d, default 512\n",
+        128 << max_sector_size());
+    printf("    -j N, --jobs=N     decode tracks in N threads, 0 - all processors\n");
+    printf("    --stats=json       print run statistics as JSON on exit\n");
+    printf("    --trace=FILE       record events to FILE, convert with mfmtrace\n");
+    printf("    --direct           write the output bypassing the page cache\n");
+    printf("    --sync             flush the output to the disk before exit\n");
     exit(-1);
 }
 
@@ -109,6 +147,20 @@ FILE *open_output(char *filename)
     return fout;
 }
 
+/*
+ * Выбор декодера. Файл проверяем по выборке дорожек,
+ * а из канала можно посмотреть только нулевую дорожку.
+ */
+int is_amiga(mfm_image_t *img)
+{
+    mfm_detect_t det;
+
+    if (! img->map)
+        return mfm_detect_amiga(img);
+    mfm_detect(img, DETECT_TRACKS, &det);
+    return det.format == MFM_FORMAT_AMIGA;
+}
+
 int main(int argc, char **argv)
 {
     static struct option longopts[] = {
@@ -118,24 +170,45 @@ int main(int argc, char **argv)
         { "info",               0, 0,   'i'     },
         { "extract",            0, 0,   'x'     },
         { "create",             0, 0,   'c'     },
-        { "dump",               0, 0,   'd'     },
+        { "dump",               2, 0,   'd'     },
         { "amiga",              0, 0,   'a'     },
         { "bk",                 0, 0,   'b'     },
         { "sectors-per-track",  1, 0,   's'     },
         { "revolution",         1, 0,   'r'     },
+        { "sector-size",        1, 0,   'z'     },
+        { "jobs",               1, 0,   'j'     },
+        { "tracks",             1, 0,   't'     },
+        { "stats",              1, 0,   'S'     },
+        { "trace",              1, 0,   'T'     },
+        { "sector",             1, 0,   'R'     },
+        { "write-sector",       1, 0,   'W'     },
+        { "direct",             0, 0,   'D'     },
+        { "sync",               0, 0,   'Y'     },
+        { "detect",             2, 0,   'F'     },
         { 0,                    0, 0,   0       },
     };
     int c;
     FILE *fin, *fout;
+    mfm_image_t image;
     int action = ACTION_INFO;
     int amiga = 0;
     int bk = 0;
     int nsectors_per_track = 9;
+    int geometry = 0;
+    int size = 2;
     int revolution = 0;
+    int dump_format = MFM_DUMP_BITS;
+    int first_track = 0, last_track = MAXTRACK - 1;
+    char *end;
+    int cylinder = 0, head = 0, sector = 1, bad_crc, nbytes;
+    static unsigned char sector_data [MAXSECTSZ + 1];
+    mfm_index_t *index;
+    mfm_detect_t det;
+    int nsample = DETECT_TRACKS, i;
 
     mfm_err = stdout;
     for (;;) {
-        c = getopt_long(argc, argv, "hVixcdvabs:r:", longopts, 0);
+        c = getopt_long(argc, argv, "hVixcdvabs:r:z:j:t:", longopts, 0);
         if (c < 0)
             break;
         switch (c) {
@@ -156,6 +229,12 @@ int main(int argc, char **argv)
             break;
         case 'd':
             action = ACTION_DUMP;
+            if (! optarg || strcmp(optarg, "bits") == 0)
+                dump_format = MFM_DUMP_BITS;
+            else if (strcmp(optarg, "hex") == 0)
+                dump_format = MFM_DUMP_HEX;
+            else
+                usage();
             break;
         case 'v':
             ++mfm_verbose;
@@ -164,18 +243,73 @@ int main(int argc, char **argv)
             amiga = 1;
             bk = 0;
             nsectors_per_track = 11;
+            geometry = 1;
             break;
         case 'b':
             bk = 1;
             amiga = 0;
             nsectors_per_track = 10;
+            geometry = 1;
             break;
         case 's':
             nsectors_per_track = strtol(optarg, 0, 0);
+            if (nsectors_per_track < 1 || nsectors_per_track > MAXSECT)
+                usage();
+            geometry = 1;
             break;
         case 'r':
             revolution = strtol(optarg, 0, 0);
             break;
+        case 'z':
+            c = strtol(optarg, 0, 0);
+            for (size=0; size<=MAXSIZE; ++size)
+                if ((128 << size) == c)
+                    break;
+            if (size > max_sector_size())
+                usage();
+            geometry = 1;
+            break;
+        case 'j':
+            mfm_jobs = strtol(optarg, 0, 0);
+            if (mfm_jobs <= 0)
+                mfm_jobs = mfm_jobs_online();
+            break;
+        case 't':
+            first_track = last_track = strtol(optarg, &end, 0);
+            if (*end == '-')
+                last_track = strtol(end + 1, &end, 0);
+            if (*end || first_track < 0 || last_track < first_track ||
+                last_track >= MAXTRACK)
+                usage();
+            break;
+        case 'R':
+        case 'W':
+            action = (c == 'R') ? ACTION_SECTOR : ACTION_REWRITE;
+            if (sscanf(optarg, "%d/%d/%d", &cylinder, &head, &sector) != 3)
+                usage();
+            break;
+        case 'S':
+            if (strcmp(optarg, "json") != 0)
+                usage();
+            mfm_stats_start();
+            break;
+        case 'T':
+            mfm_trace_start(optarg);
+            break;
+        case 'F':
+            action = ACTION_DETECT;
+            if (optarg) {
+                nsample = strtol(optarg, &end, 10);
+                if (*end || nsample < 1)
+                    usage();
+            }
+            break;
+        case 'D':
+            mfm_direct = 1;
+            break;
+        case 'Y':
+            mfm_sync = 1;
+            break;
         }
     }
     argc -= optind;
@@ -187,35 +321,138 @@ int main(int argc, char **argv)
         /* Выдача информации о файле MFM. */
         if (argc != 1)
             usage();
+        mfm_stats_phase("analyze");
         fin = open_input(argv[0]);
+        mfm_image_open(&image, fin, mfm_verbose ? MFM_SEQUENTIAL : MFM_RANDOM);
 
-        if (mfm_detect_amiga(fin))
-            mfm_analyze_amiga(fin, mfm_verbose ? MAXTRACK : 1);
+        if (is_amiga(&image))
+            mfm_analyze_amiga(&image, mfm_verbose ? MAXTRACK : 1);
         else
-            mfm_analyze_ibmpc(fin, mfm_verbose ? MAXTRACK : 1);
+            mfm_analyze_ibmpc(&image, mfm_verbose ? MAXTRACK : 1);
+        mfm_image_close(&image);
+        break;
+
+    case ACTION_DETECT:
+        /* Быстрое определение формата нескольких файлов MFM. */
+        if (argc < 1)
+            usage();
+        mfm_stats_phase("detect");
+        for (i=0; i<argc; ++i) {
+            fin = open_input(argv[i]);
+            mfm_image_open(&image, fin, MFM_RANDOM);
+            mfm_detect(&image, nsample, &det);
+            mfm_image_close(&image);
+            if (fin != stdin)
+                fclose(fin);
+
+            printf("%s: %s", argv[i], mfm_format_name(det.format));
+            if (det.format != MFM_FORMAT_UNKNOWN)
+                printf(", %d x %d x %d x %d bytes, confidence %d%%",
+                    det.ncylinders, det.nheads, det.nsectors_per_track,
+                    128 << det.size, det.confidence);
+            if (det.mixed)
+                printf(", mixed formats");
+            printf("\n");
+        }
         break;
 
     case ACTION_DUMP:
         /* Выдача битового содержимого файла MFM. */
         if (argc != 1)
             usage();
+        mfm_stats_phase("dump");
         fin = open_input(argv[0]);
-        mfm_dump(fin, MAXTRACK);
+        mfm_image_open(&image, fin, MFM_SEQUENTIAL);
+        mfm_dump(&image, first_track, last_track + 1, dump_format);
+        mfm_image_close(&image);
+        break;
+
+    case ACTION_SECTOR:
+        /* Чтение одного сектора по индексу. */
+        if (argc != 2)
+            usage();
+        mfm_stats_phase("index");
+        fin = open_input(argv[0]);
+        mfm_image_open(&image, fin, MFM_RANDOM);
+        index = mfm_index_open(&image, (fin == stdin) ? 0 : argv[0]);
+
+        mfm_stats_phase("read");
+        size = mfm_index_read_sector(index, &image, cylinder, head, sector,
+            sector_data, &bad_crc);
+        if (size < 0) {
+            fprintf(stderr, "%s: no sector %d/%d/%d\n",
+                argv[0], cylinder, head, sector);
+            exit(-1);
+        }
+        if (bad_crc)
+            fprintf(mfm_err, "Track %d/%d sector %d: bad data sum\n",
+                cylinder, head, sector);
+        mfm_index_free(index);
+        mfm_image_close(&image);
+
+        mfm_stats_phase("write");
+        fout = open_output(argv[1]);
+        mfm_output_write(fout, sector_data, 128 << size);
+        mfm_output_finish(fout);
+        break;
+
+    case ACTION_REWRITE:
+        /* Замена данных одного сектора прямо в файле MFM. */
+        if (argc != 2)
+            usage();
+        fin = open_input(argv[1]);
+        nbytes = fread(sector_data, 1, sizeof(sector_data), fin);
+
+        mfm_stats_phase("index");
+        fout = fopen(argv[0], "r+b");
+        if (! fout) {
+            perror(argv[0]);
+            exit(-1);
+        }
+        mfm_image_open(&image, fout, MFM_RANDOM);
+        index = mfm_index_open(&image, argv[0]);
+
+        mfm_stats_phase("write");
+        if (mfm_index_write_sector(index, &image, cylinder, head, sector,
+            sector_data, nbytes) < 0) {
+            fprintf(stderr, "%s: cannot rewrite sector %d/%d/%d\n",
+                argv[0], cylinder, head, sector);
+            exit(-1);
+        }
+        mfm_index_free(index);
+        mfm_output_finish(fout);
+        mfm_image_close(&image);
         break;
 
     case ACTION_EXTRACT:
         /* Извлечение данных из файла MFM. */
         if (argc != 2)
             usage();
+        mfm_stats_phase("decode");
         fin = open_input(argv[0]);
         fout = open_output(argv[1]);
+        mfm_image_open(&image, fin, MFM_SEQUENTIAL);
 
-        if (amiga || mfm_detect_amiga(fin))
-            mfm_read_amiga(&disk, fin, MAXTRACK);
+        if (! image.map) {
+            /* Вход из канала: выдаём дорожки по мере декодирования. */
+            if (amiga || mfm_detect_amiga(&image))
+                mfm_stream_amiga(&image, MAXTRACK, fout);
+            else
+                mfm_stream_ibmpc(&image, MAXTRACK, fout);
+            mfm_image_close(&image);
+            mfm_output_finish(fout);
+            break;
+        }
+        if (amiga || is_amiga(&image))
+            disk = mfm_read_amiga(&image, MAXTRACK);
         else
-            mfm_read_ibmpc(&disk, fin, MAXTRACK);
+            disk = mfm_read_ibmpc(&image, MAXTRACK);
+        mfm_image_close(&image);
 
-        mfm_write_raw(&disk, fout);
+        mfm_stats_phase("write");
+        mfm_write_raw(disk, fout);
+        mfm_output_finish(fout);
+        mfm_disk_free(disk);
         break;
 
     case ACTION_CREATE:
@@ -230,15 +467,19 @@ int main(int argc, char **argv)
 
             if (ext && strcasecmp(ext, ".scp") == 0) {
                 /* Convert SCP file into MFM format. */
+                mfm_stats_phase("convert");
                 scp_write_mfm(argv[1], fout, revolution);
+                mfm_output_finish(fout);
                 break;
             }
+            mfm_stats_phase("read");
             fin = open_input(argv[1]);
-            mfm_read_raw(&disk, fin, nsectors_per_track);
+            /* Из канала без -s и -z геометрию берём из BPB. */
+            disk = mfm_open_raw(fin, geometry ? nsectors_per_track : 0,
+                amiga ? 2 : size);
         } else {
             /* Empty disk. */
-            disk.ntracks = 160;
-            disk.nsectors_per_track = nsectors_per_track;
+            disk = mfm_disk_alloc(160, nsectors_per_track, amiga ? 2 : size);
         }
 
         if (! mfm_index_gap)
@@ -246,14 +487,25 @@ int main(int argc, char **argv)
         if (! mfm_data_gap)
             mfm_data_gap = DATA_GAP;
         if (! mfm_sector_gap) {
-            mfm_sector_gap = (nsectors_per_track == 10) ?
+            mfm_sector_gap = (disk->nsectors_per_track == 10) ?
                 SECTOR_GAP_10 : SECTOR_GAP_9;
         }
 
+        /* Секторы IBM PC должны поместиться на дорожку. */
+        if (! amiga && mfm_ibmpc_track_bytes(disk->nsectors_per_track,
+                disk->size) > TRACKSZ / 2) {
+            fprintf(mfm_err, "%d sectors of %d bytes do not fit in a track, aborted.\n",
+                disk->nsectors_per_track, disk->sector_bytes);
+            exit(-1);
+        }
+
+        mfm_stats_phase("encode");
         if (amiga)
-            mfm_write_amiga(&disk, fout);
+            mfm_write_amiga(disk, fout);
         else
-            mfm_write_ibmpc(&disk, fout, bk);
+            mfm_write_ibmpc(disk, fout, bk);
+        mfm_output_finish(fout);
+        mfm_disk_free(disk);
         break;
     }
     return 0;
@@ -26,29 +26,118 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "config.h"
 #include "mfm.h"
 
+#ifdef __BMI2__
+#   include <immintrin.h>
+#endif
+
+__thread FILE *mfm_err;
 int mfm_gap_byte = 0x4e;
 
 /*
- * Чтение полубита.
+ * Таблица декодирования: из восьми полубитов берём четыре бита данных
+ * (второй полубит каждой пары).
  */
-int mfm_read_halfbit(mfm_reader_t *reader)
+static const unsigned char decode_tab [256] = {
+    0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3, 0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3,
+    0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7, 0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7,
+    0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3, 0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3,
+    0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7, 0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7,
+    0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb, 0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb,
+    0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf, 0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf,
+    0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb, 0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb,
+    0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf, 0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf,
+    0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3, 0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3,
+    0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7, 0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7,
+    0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3, 0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3,
+    0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7, 0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7,
+    0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb, 0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb,
+    0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf, 0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf,
+    0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb, 0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb,
+    0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf, 0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf,
+};
+
+/*
+ * Декодирование 16 полубитов в байт данных.
+ */
+int mfm_decode_word(unsigned word)
 {
-    /* Дорожка закончилась. */
-    if (reader->halfbit >= 102400)
-        return -1;
+    return decode_tab [word >> 8 & 0xff] << 4 | decode_tab [word & 0xff];
+}
 
-    if ((reader->halfbit & 7) == 0)
-        reader->byte = getc(reader->fd);
+/*
+ * Загрузка 64-битного слова из дорожки, начиная с байта pos.
+ * За концом дорожки считаем нули.
+ */
+static inline uint64_t load_word(const mfm_reader_t *reader, int pos)
+{
+    const unsigned char *p = reader->data + pos;
+    uint64_t word;
+    int i;
 
-    if (reader->byte < 0)
+    if (pos + 8 <= reader->nbytes) {
+        return (uint64_t) p[0] << 56 | (uint64_t) p[1] << 48 |
+               (uint64_t) p[2] << 40 | (uint64_t) p[3] << 32 |
+               (uint64_t) p[4] << 24 | (uint64_t) p[5] << 16 |
+               (uint64_t) p[6] << 8  | p[7];
+    }
+    word = 0;
+    for (i=0; i<8; ++i) {
+        word <<= 8;
+        if (pos + i < reader->nbytes)
+            word |= p[i];
+    }
+    return word;
+}
+
+/*
+ * Просмотр очередных n полубитов (от 1 до 57) без продвижения.
+ * Первый полубит оказывается в старшем разряде результата.
+ */
+uint64_t mfm_peek_bits(mfm_reader_t *reader, int n)
+{
+    uint64_t word;
+
+    word = load_word(reader, reader->halfbit >> 3);
+    return (word << (reader->halfbit & 7)) >> (64 - n);
+}
+
+/*
+ * Пропуск n полубитов.
+ */
+void mfm_skip_bits(mfm_reader_t *reader, int n)
+{
+    reader->halfbit += n;
+}
+
+/*
+ * Извлечение очередных n полубитов (от 1 до 57).
+ * Возвращаем -1, если до конца дорожки осталось меньше.
+ */
+int64_t mfm_extract_bits(mfm_reader_t *reader, int n)
+{
+    uint64_t word;
+
+    if (reader->halfbit + n > reader->nhalfbits)
         return -1;
+    word = mfm_peek_bits(reader, n);
+    reader->halfbit += n;
+    return word;
+}
 
-    ++reader->halfbit;
-    reader->byte <<= 1;
-    return reader->byte >> 8 & 1;
+/*
+ * Чтение полубита.
+ */
+int mfm_read_halfbit(mfm_reader_t *reader)
+{
+    return mfm_extract_bits(reader, 1);
 }
 
 /*
@@ -56,13 +145,23 @@ int mfm_read_halfbit(mfm_reader_t *reader)
  */
 int mfm_read_bit(mfm_reader_t *reader)
 {
-    int a, b;
+    int64_t val;
+
+    val = mfm_extract_bits(reader, 2);
+    if (val < 0)
+        return -1;
+    return val & 1;
+}
 
-    a = mfm_read_halfbit(reader);
-    b = mfm_read_halfbit(reader);
-    if (a < 0 || b < 0)
+/*
+ * Декодирование очередного байта, без продвижения.
+ * Возвращаем -1, если до конца дорожки осталось меньше байта.
+ */
+int mfm_peek_byte(mfm_reader_t *reader)
+{
+    if (reader->halfbit + 16 > reader->nhalfbits)
         return -1;
-    return b;
+    return mfm_decode_word(mfm_peek_bits(reader, 16));
 }
 
 /*
@@ -70,32 +169,178 @@ int mfm_read_bit(mfm_reader_t *reader)
  */
 int mfm_read_byte(mfm_reader_t *reader)
 {
-    int byte, bit, i;
+    int64_t word;
 
-    byte = 0;
-    for (i=0; i<8; ++i) {
-        bit = mfm_read_bit(reader);
-        if (bit < 0)
-            return 0;
-        byte <<= 1;
-        byte |= bit;
+    word = mfm_extract_bits(reader, 16);
+    if (word < 0) {
+        /* Дорожка закончилась: отбрасываем остаток. */
+        reader->halfbit = reader->nhalfbits;
+        return 0;
     }
-    return byte;
+    return mfm_decode_word(word);
+}
+
+/*
+ * Декодирование массива байтов, например поля данных сектора.
+ * Если дорожка закончилась, остаток заполняется нулями.
+ */
+void mfm_read_bytes(mfm_reader_t *reader, unsigned char *data, int nbytes)
+{
+    int n;
+
+    n = (reader->nhalfbits - reader->halfbit) / 16;
+    if (n > nbytes)
+        n = nbytes;
+    if (n > 0) {
+        mfm_decode(data, reader->data, reader->halfbit, n);
+        reader->halfbit += 16 * n;
+    }
+    for (; n < nbytes; ++n)
+        data[n] = mfm_read_byte(reader);
+}
+
+/*
+ * Декодирование поля данных сразу на место назначения
+ * с подсчётом контрольной суммы за тот же проход: каждый
+ * кусок суммируется, пока он ещё в кэше первого уровня.
+ * Возвращает сумму sum, продолженную по данным.
+ */
+unsigned short mfm_read_bytes_crc(mfm_reader_t *reader, unsigned char *data,
+    int nbytes, unsigned short sum)
+{
+    int n, k;
+
+    n = (reader->nhalfbits - reader->halfbit) / 16;
+    if (n > nbytes)
+        n = nbytes;
+    for (k=0; k<n; k+=256) {
+        int len = (n - k < 256) ? n - k : 256;
+
+        mfm_decode(data + k, reader->data, reader->halfbit, len);
+        sum = mfm_crc16_ccitt(sum, data + k, len);
+        reader->halfbit += 16 * len;
+    }
+    for (; n < nbytes; ++n) {
+        data[n] = mfm_read_byte(reader);
+        sum = mfm_crc16_byte(sum, data[n]);
+    }
+    return sum;
+}
+
+/*
+ * Открытие MFM-образа на чтение.
+ * Обычный файл отображаем в память, access подсказывает ядру
+ * порядок обращения к дорожкам. Для каналов остаётся stdio.
+ */
+void mfm_image_open(mfm_image_t *img, FILE *fin, int access)
+{
+    struct stat st;
+    void *map;
+
+    img->fd = fin;
+    img->map = 0;
+    img->size = 0;
+    img->track = 0;
+    img->track_bytes = 0;
+    img->next = 0;
+    if (fstat(fileno(fin), &st) < 0 || ! S_ISREG(st.st_mode) ||
+        st.st_size == 0)
+        return;
+
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fin), 0);
+    if (map == MAP_FAILED)
+        return;
+#ifdef MADV_SEQUENTIAL
+    madvise(map, st.st_size,
+        (access == MFM_RANDOM) ? MADV_RANDOM : MADV_SEQUENTIAL);
+#endif
+    img->map = map;
+    img->size = st.st_size;
+}
+
+/*
+ * Закрытие MFM-образа.
+ */
+void mfm_image_close(mfm_image_t *img)
+{
+    if (img->map) {
+        munmap((void*) img->map, img->size);
+        img->map = 0;
+    }
+    free(img->track);
+    img->track = 0;
+}
+
+/*
+ * Чтение дорожки из канала, где возможно только движение вперёд.
+ * Последняя прочитанная дорожка хранится в образе, так что её
+ * можно запросить повторно; к предыдущим вернуться нельзя.
+ * Возвращаем длину дорожки в байтах.
+ */
+static int read_stream(mfm_image_t *img, int t)
+{
+    uint64_t t0;
+
+    if (! img->track) {
+        img->track = malloc(TRACKSZ);
+        if (! img->track) {
+            fprintf(stderr, "Out of memory, aborted.\n");
+            exit(-1);
+        }
+    }
+    while (img->next <= t) {
+        t0 = MFM_TRACE_CLOCK();
+        img->track_bytes = fread(img->track, 1, TRACKSZ, img->fd);
+        MFM_TRACE_IO(MFM_EV_READ, img->next, img->track_bytes, t0);
+        img->next++;
+    }
+    if (t != img->next - 1)
+        return 0;
+    return img->track_bytes;
 }
 
 /*
  * Подготовка к чтению очередной дорожки.
+ * Из отображённого образа дорожка берётся без копирования,
+ * иначе загружаем её целиком в память.  Из канала дорожки
+ * можно читать только по порядку.
  */
-void mfm_read_seek(mfm_reader_t *reader, FILE *fin, int t)
+void mfm_read_seek(mfm_reader_t *reader, mfm_image_t *img, int t)
 {
-    reader->fd = fin;
+    size_t offset = (size_t) t * TRACKSZ;
+    uint64_t t0;
+
     reader->track = t;
     reader->halfbit = 0;
-    fseek(reader->fd, t * 12800L, SEEK_SET);
+    reader->data = reader->buf;
+    reader->nbytes = 0;
+    if (img->map) {
+        if (offset < img->size) {
+            reader->data = img->map + offset;
+            reader->nbytes = (img->size - offset > TRACKSZ) ?
+                TRACKSZ : img->size - offset;
+        }
+    } else if (fseek(img->fd, offset, SEEK_SET) == 0) {
+        t0 = MFM_TRACE_CLOCK();
+        reader->nbytes = fread(reader->buf, 1, TRACKSZ, img->fd);
+        MFM_TRACE_IO(MFM_EV_READ, t, reader->nbytes, t0);
+    } else {
+        /* Канал: дорожки идут только подряд. */
+        reader->nbytes = read_stream(img, t);
+        if (reader->nbytes > 0)
+            reader->data = img->track;
+    }
+    reader->nhalfbits = reader->nbytes * 8;
+    if (reader->nbytes > 0) {
+        mfm_stat_add(MFM_STAT_TRACKS_READ, 1);
+        mfm_stat_add(MFM_STAT_BYTES_READ, reader->nbytes);
+    }
 }
 
 /*
  * Подготовка к записи очередной дорожки.
+ * Дорожка собирается в буфере; если задан файл,
+ * она выводится туда целиком по заполнении.
  */
 void mfm_write_reset(mfm_writer_t *writer, FILE *fout)
 {
@@ -104,6 +349,26 @@ void mfm_write_reset(mfm_writer_t *writer, FILE *fout)
     writer->last = 0;
 }
 
+/*
+ * Дорожка заполнена: выводим её.
+ */
+static void write_track_done(mfm_writer_t *writer)
+{
+    mfm_stat_add(MFM_STAT_TRACKS_WRITTEN, 1);
+    if (writer->fd)
+        mfm_output_write(writer->fd, writer->buf, TRACKSZ);
+}
+
+/*
+ * Дорожка собрана прямо в буфере writer->buf: выводим её.
+ */
+void mfm_write_done(mfm_writer_t *writer)
+{
+    writer->halfbit = 102400;
+    writer->last = writer->buf[TRACKSZ - 1] & 1;
+    write_track_done(writer);
+}
+
 /*
  * Кодирование одного полубита.
  */
@@ -118,8 +383,11 @@ void mfm_write_halfbit(mfm_writer_t *writer, int val)
     writer->byte |= val;
     writer->last = val;
     ++writer->halfbit;
-    if ((writer->halfbit & 7) == 0)
-        putc(writer->byte, writer->fd);
+    if ((writer->halfbit & 7) == 0) {
+        writer->buf [(writer->halfbit >> 3) - 1] = writer->byte;
+        if (writer->halfbit == 102400)
+            write_track_done(writer);
+    }
 }
 
 /*
@@ -139,78 +407,153 @@ void mfm_write_bit(mfm_writer_t *writer, int val)
 }
 
 /*
- * Кодирование очередного байта.
+ * Раскладываем 32 бита данных по чётным позициям 64-битного слова:
+ * бит j переходит в бит 2j.
  */
-void mfm_write_byte(mfm_writer_t *writer, int val)
+static inline uint64_t spread_bits(uint32_t data)
 {
-    int i;
+#ifdef __BMI2__
+    return _pdep_u64(data, 0x5555555555555555ULL);
+#else
+    uint64_t x = data;
 
-    for (i=0; i<8; ++i) {
-        mfm_write_bit(writer, val >> 7);
-        val <<= 1;
-    }
+    x = (x | x << 16) & 0x0000ffff0000ffffULL;
+    x = (x | x << 8)  & 0x00ff00ff00ff00ffULL;
+    x = (x | x << 4)  & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | x << 2)  & 0x3333333333333333ULL;
+    x = (x | x << 1)  & 0x5555555555555555ULL;
+    return x;
+#endif
 }
 
 /*
- * Кодирование массива байтов.
+ * Кодирование 32 битов данных в 64 полубита.
+ * Тактовый полубит ставится между двумя нулями;
+ * last - предыдущий записанный полубит.
  */
-void mfm_write(mfm_writer_t *writer, unsigned char *data, int nbytes)
+static inline uint64_t encode_long(uint32_t data, int last)
 {
-    while (nbytes-- > 0)
-        mfm_write_byte(writer, *data++);
+    uint64_t x = spread_bits(data);
+    uint64_t clock;
+
+    clock = ~(x << 1 | x >> 1 | (uint64_t) last << 63);
+    return x | (clock & 0xaaaaaaaaaaaaaaaaULL);
 }
 
 /*
- * Заполнение зазора.
+ * Кодирование массива байтов в буфер out (по два байта на каждый).
+ * Параметр last - значение предыдущего полубита.
+ * Возвращаем значение последнего полубита.
  */
-void mfm_write_gap(mfm_writer_t *writer, int nbytes, int val)
+int mfm_encode(unsigned char *out, const unsigned char *data, int nbytes, int last)
 {
-    while (nbytes-- > 0)
-        mfm_write_byte(writer, val);
+    uint64_t word;
+    uint32_t val;
+
+    for (; nbytes >= 4; nbytes -= 4) {
+        val = (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+        word = encode_long(val, last);
+        out[0] = word >> 56;
+        out[1] = word >> 48;
+        out[2] = word >> 40;
+        out[3] = word >> 32;
+        out[4] = word >> 24;
+        out[5] = word >> 16;
+        out[6] = word >> 8;
+        out[7] = word;
+        last = val & 1;
+        data += 4;
+        out += 8;
+    }
+    for (; nbytes > 0; nbytes--) {
+        word = encode_long((uint32_t) *data << 24, last);
+        out[0] = word >> 56;
+        out[1] = word >> 48;
+        last = *data++ & 1;
+        out += 2;
+    }
+    return last;
 }
 
 /*
- * Заполнение зазора до конца дорожки.
+ * Запись закодированных полубитов: по байтам, если позиция выровнена,
+ * иначе по одному полубиту.
  */
-void mfm_fill_track(mfm_writer_t *writer, int val)
+static void write_raw(mfm_writer_t *writer, const unsigned char *raw, int nbytes)
 {
-    while (writer->halfbit < 102400)
-        mfm_write_byte(writer, val);
+    int n, i;
+
+    if ((writer->halfbit & 7) == 0) {
+        /* Помещается до конца дорожки. */
+        n = (102400 - writer->halfbit) / 8;
+        if (n > nbytes)
+            n = nbytes;
+        if (n > 0) {
+            memcpy(writer->buf + (writer->halfbit >> 3), raw, n);
+            writer->halfbit += n * 8;
+            writer->last = raw[n-1] & 1;
+            raw += n;
+            nbytes -= n;
+            if (writer->halfbit == 102400)
+                write_track_done(writer);
+        }
+    }
+    for (; nbytes > 0; nbytes--) {
+        for (i=7; i>=0; --i)
+            mfm_write_halfbit(writer, *raw >> i);
+        raw++;
+    }
 }
 
-void mfm_dump(FILE *fin, int ntracks)
+/*
+ * Кодирование очередного байта.
+ */
+void mfm_write_byte(mfm_writer_t *writer, int val)
 {
-    mfm_reader_t reader;
-    int t, i, a, b, last_b;
+    unsigned char data = val, raw [2];
 
-    for (t=0; t<ntracks; ++t) {
-        mfm_read_seek(&reader, fin, t);
-        a = b = last_b = 0;
-        fprintf(mfm_err, "Track %d/%d:\n", t >> 1, t & 1);
-        for (i=0;; ++i) {
-            if (mfm_verbose)
-                b = mfm_read_halfbit(&reader);
-            else {
-                last_b = b;
-                a = mfm_read_halfbit(&reader);
-                b = mfm_read_halfbit(&reader);
-                if (! a && ! b && last_b)
-                    a = 1;
-            }
+    mfm_encode(raw, &data, 1, writer->last);
+    write_raw(writer, raw, 2);
+}
+
+/*
+ * Кодирование массива байтов.
+ */
+void mfm_write(mfm_writer_t *writer, unsigned char *data, int nbytes)
+{
+    unsigned char raw [2*256];
+    int n;
 
-            if (b < 0)
-                break;
+    while (nbytes > 0) {
+        n = (nbytes > 256) ? 256 : nbytes;
+        mfm_encode(raw, data, n, writer->last);
+        write_raw(writer, raw, 2*n);
+        data += n;
+        nbytes -= n;
+    }
+}
 
-            if (mfm_verbose || a != b)
-                fprintf(mfm_err, "%d", b);
-            else
-                fprintf(mfm_err, b ? "#" : "_");
+/*
+ * Заполнение зазора.
+ */
+void mfm_write_gap(mfm_writer_t *writer, int nbytes, int val)
+{
+    unsigned char data [256];
+    int n;
 
-            if ((i & 63) == 63)
-                fprintf(mfm_err, "\n");
-        }
-        fprintf(mfm_err, "\n");
-        if (reader.fd)
-            break;
+    memset(data, val, (nbytes > 256) ? 256 : nbytes);
+    while (nbytes > 0) {
+        n = (nbytes > 256) ? 256 : nbytes;
+        mfm_write(writer, data, n);
+        nbytes -= n;
     }
 }
+
+/*
+ * Заполнение зазора до конца дорожки.
+ */
+void mfm_fill_track(mfm_writer_t *writer, int val)
+{
+    if (writer->halfbit < 102400)
+        mfm_write_gap(writer, (102400 - writer->halfbit + 15) / 16, val);
+}
@@ -25,64 +25,387 @@
  * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#include <stdint.h>
+
 #define MAXTRACK        160
-#define MAXSECT         11
+#define MAXSECT         32      /* sectors per track, up to a bitmap word */
 #define SECTSZ          512
+#define MAXSIZE         6       /* largest sector size code */
+#define MAXSECTSZ       (128 << MAXSIZE)
+#define TRACKSZ         12800   /* bytes per track in MFM image */
 
 #define INDEX_GAP       42      /* before first sector */
 #define DATA_GAP        22      /* between sector mark and data */
 #define SECTOR_GAP_9    80      /* 720k, 9 sectors per track */
 #define SECTOR_GAP_10   46      /* 800k, 10 sectors per track */
 
+/*
+ * Состояние секторов одной дорожки.
+ */
+typedef struct {
+    uint32_t present;           /* битовая маска прочитанных секторов */
+    uint32_t bad_crc;           /* сектора с ошибкой контрольной суммы */
+    unsigned char size [MAXSECT]; /* код размера сектора: 128 << size байт */
+} mfm_track_t;
+
+/*
+ * Образ дискеты. Память выделяется одним блоком по реальной
+ * геометрии: заголовок, таблица дорожек и все сектора подряд,
+ * каждый в ячейке по 128 << size байт.
+ */
 typedef struct {
     int ntracks;                /* 80 или 160 */
-    int nsectors_per_track;     /* 9..11 */
-    unsigned char block [MAXTRACK] [MAXSECT] [SECTSZ];
+    int nsectors_per_track;     /* 1..MAXSECT */
+    int size;                   /* код размера ячейки сектора, 2 для 512 байт */
+    int sector_bytes;           /* размер ячейки сектора */
+    mfm_track_t *track;         /* [ntracks] */
+    unsigned char *data;        /* [ntracks] [nsectors_per_track] [sector_bytes] */
+    int nrows;                  /* дорожек в памяти: дорожка t в строке t % nrows */
+    FILE *fin;                  /* если не 0, сектора ещё в файле: читаем по дорожкам */
+    int prefetched;             /* байтов дорожки 0, уже прочитанных из fin */
 } mfm_disk_t;
 
+/*
+ * Сектора одной дорожки, прочитанные из MFM-образа,
+ * до того как геометрия диска известна.
+ */
+typedef struct {
+    mfm_track_t info;
+    int track;                  /* номер дорожки */
+    unsigned short offset [MAXSECT]; /* смещение сектора в data */
+    int nbytes;                 /* занято в data */
+    unsigned char data [TRACKSZ / 2];
+} mfm_track_data_t;
+
+/*
+ * Индекс секторов MFM-образа: где на дорожке лежат поля
+ * идентификатора и данных каждого сектора.
+ */
+#define MFM_INDEX_BAD_ID    1   /* ошибка контрольной суммы идентификатора */
+#define MFM_INDEX_NO_DATA   2   /* нет поля данных */
+#define MFM_INDEX_BAD_DATA  4   /* ошибка контрольной суммы данных */
+
+typedef struct {
+    int32_t id_halfbit;         /* первый байт идентификатора, после метки FE */
+    int32_t data_halfbit;       /* первый байт данных, после метки, или -1 */
+    uint8_t cylinder;           /* поля идентификатора C/H/R/N */
+    uint8_t head;
+    uint8_t sector;
+    uint8_t size;
+    uint8_t tag;                /* метка данных: FB или F8 */
+    uint8_t flags;              /* MFM_INDEX_... */
+    uint16_t unused;
+} mfm_index_entry_t;
+
+typedef struct {
+    uint64_t image_size;        /* ключ: размер, время изменения */
+    int64_t image_mtime;        /* и выборочный хэш образа */
+    int64_t image_mtime_nsec;
+    uint64_t image_hash;
+    int ntracks;
+    uint32_t first [MAXTRACK + 1]; /* записи дорожки t: first[t]..first[t+1]-1 */
+    mfm_index_entry_t *entry;
+    char *sidecar;              /* файл индекса, или 0 */
+} mfm_index_t;
+
+#define MFM_SYNC_A1     0x4489  /* A1 с нарушением кодирования */
+#define MFM_SYNC_C2     0x5224  /* C2 с нарушением кодирования */
+#define MFM_SYNC_C2_ALT 0x5284  /* C2, как его пишет mfm_write_ibmpc() */
+
 typedef struct {
-    FILE *fd;
+    int halfbit;                /* смещение первого синхрослова */
+    int sync;                   /* синхрослово: MFM_SYNC_A1, MFM_SYNC_C2... */
+    int count;                  /* количество синхрослов подряд */
+} mfm_mark_t;
+
+typedef struct {
+    FILE *fd;                   /* файл образа */
+    const unsigned char *map;   /* образ, отображённый в память, или 0 */
+    size_t size;                /* размер отображения */
+    unsigned char *track;       /* последняя дорожка, прочитанная из канала */
+    int track_bytes;            /* её длина */
+    int next;                   /* следующая дорожка в канале */
+} mfm_image_t;
+
+/*
+ * Результат определения формата дискеты по выборке дорожек.
+ */
+#define MFM_FORMAT_UNKNOWN  0
+#define MFM_FORMAT_IBMPC    1
+#define MFM_FORMAT_AMIGA    2
+#define MFM_FORMAT_BK       3   /* IBM PC без маркера индекса */
+#define MFM_NFORMATS        4
+
+typedef struct {
+    int format;                 /* MFM_FORMAT_... */
+    int confidence;             /* уверенность, 0...100 % */
+    int mixed;                  /* на дорожках встречаются разные форматы */
+    int ncylinders;
+    int nheads;
+    int nsectors_per_track;
+    int size;                   /* код размера сектора */
+    int nsampled;               /* просмотрено дорожек */
+    int votes [MFM_NFORMATS];   /* дорожек каждого формата */
+} mfm_detect_t;
+
+#define MFM_SEQUENTIAL  0       /* дорожки читаются подряд */
+#define MFM_RANDOM      1       /* произвольный доступ к дорожкам */
+
+#define MFM_DUMP_BITS   0       /* mfm_dump(): ячейки или полубиты */
+#define MFM_DUMP_HEX    1       /* mfm_dump(): байты в шестнадцатеричном виде */
+
+typedef struct {
+    const unsigned char *data;  /* содержимое дорожки */
+    int nbytes;                 /* длина дорожки в байтах */
+    int nhalfbits;              /* длина дорожки в полубитах */
     int track;                  /* 0..159 */
     int halfbit;                /* 0..102400 */
-    int byte;
+    unsigned char buf [TRACKSZ];
 } mfm_reader_t;
 
 typedef struct {
-    FILE *fd;
+    FILE *fd;                   /* куда выводить дорожку, или 0 */
     int last;
     int halfbit;                /* 0..102400 */
     int byte;
+    unsigned char buf [TRACKSZ];
 } mfm_writer_t;
 
-FILE *mfm_err;
+/*
+ * Шаблон дорожки: закодированная дорожка данного формата
+ * и геометрии, в которой от диска к диску меняются только
+ * поля идентификаторов и данных. Поля выровнены по байтам.
+ */
+#define MFM_TEMPLATE_KEY    8               /* формат, геометрия, зазоры */
+#define MFM_TEMPLATE_FIELDS (2 * MAXSECT)
+
+typedef struct mfm_template_t {
+    struct mfm_template_t *next;            /* в кэше шаблонов */
+    int key [MFM_TEMPLATE_KEY];
+    int valid;                              /* все поля поместились на дорожку */
+    int nfields;
+    unsigned short offset [MFM_TEMPLATE_FIELDS]; /* начало поля в байтах дорожки */
+    unsigned short nbytes [MFM_TEMPLATE_FIELDS]; /* длина поля до кодирования */
+    unsigned char raw [TRACKSZ];
+} mfm_template_t;
+
+/*
+ * Счётчики статистики (--stats=json).
+ */
+enum {
+    MFM_STAT_TRACKS_READ,       /* прочитано дорожек MFM */
+    MFM_STAT_TRACKS_WRITTEN,    /* записано дорожек MFM */
+    MFM_STAT_MARKS,             /* найдено маркеров */
+    MFM_STAT_HEADER_CRC,        /* ошибки контрольной суммы заголовка */
+    MFM_STAT_DATA_CRC,          /* ошибки контрольной суммы данных */
+    MFM_STAT_MISSING,           /* отсутствующие сектора */
+    MFM_STAT_PLL_UNSYNC,        /* потери синхронизации PLL */
+    MFM_STAT_BYTES_READ,        /* прочитано байтов */
+    MFM_STAT_BYTES_WRITTEN,     /* записано байтов */
+    MFM_NSTATS
+};
+
+/*
+ * События трассировки (--trace=FILE).
+ */
+enum {
+    MFM_EV_TRACK_BEGIN,         /* начало обработки дорожки */
+    MFM_EV_TRACK_END,           /* конец обработки дорожки */
+    MFM_EV_MARK,                /* маркер: смещение в полубитах, тег */
+    MFM_EV_SECTOR,              /* сектор: номер, ошибка контрольной суммы */
+    MFM_EV_PLL,                 /* подстройка PLL: период, фаза в нс */
+    MFM_EV_READ,                /* чтение: байтов, длительность в нс */
+    MFM_EV_WRITE,               /* запись: байтов, длительность в нс */
+};
+
+typedef struct {
+    uint64_t time;              /* нс от начала трассировки */
+    uint16_t type;              /* MFM_EV_... */
+    uint16_t thread;            /* номер потока */
+    int32_t track;              /* дорожка или -1 */
+    int32_t arg1;
+    int32_t arg2;
+} mfm_event_t;
+
+#define MFM_TRACE_MAGIC "MFMTRACE"
+
+#ifndef MFM_NO_TRACE
+#   define MFM_TRACE(type, track, arg1, arg2) \
+        do { if (mfm_tracing) mfm_trace_event(type, track, arg1, arg2); } while (0)
+#   define MFM_TRACE_CLOCK() (mfm_tracing ? mfm_trace_clock() : 0)
+#   define MFM_TRACE_IO(type, track, nbytes, t0) \
+        MFM_TRACE(type, track, nbytes, mfm_trace_clock() - (t0))
+#else
+#   define MFM_TRACE(type, track, arg1, arg2) do {} while (0)
+#   define MFM_TRACE_CLOCK() 0
+#   define MFM_TRACE_IO(type, track, nbytes, t0) do {} while (0)
+#endif
+
+extern __thread FILE *mfm_err;  /* диагностика, своя у каждого потока */
 int mfm_verbose;
+extern int mfm_jobs;            /* количество потоков */
+extern int mfm_stats;           /* собирать статистику */
+extern int mfm_tracing;         /* записывать события */
+extern int mfm_direct;          /* писать образ мимо кэша, O_DIRECT */
+extern int mfm_sync;            /* fdatasync() после записи образа */
 int mfm_gap_byte;
 int mfm_index_gap;
 int mfm_sector_gap;
 int mfm_data_gap;
 
-void mfm_read_seek(mfm_reader_t *reader, FILE *fin, int t);
+void mfm_image_open(mfm_image_t *img, FILE *fin, int access);
+void mfm_image_close(mfm_image_t *img);
+void mfm_read_seek(mfm_reader_t *reader, mfm_image_t *img, int t);
 int mfm_read_halfbit(mfm_reader_t *reader);
 int mfm_read_bit(mfm_reader_t *reader);
 int mfm_read_byte(mfm_reader_t *reader);
-void mfm_dump(FILE *fin, int ntracks);
+int mfm_peek_byte(mfm_reader_t *reader);
+void mfm_read_bytes(mfm_reader_t *reader, unsigned char *data, int nbytes);
+unsigned short mfm_read_bytes_crc(mfm_reader_t *reader, unsigned char *data,
+    int nbytes, unsigned short sum);
+uint64_t mfm_peek_bits(mfm_reader_t *reader, int n);
+int64_t mfm_extract_bits(mfm_reader_t *reader, int n);
+void mfm_skip_bits(mfm_reader_t *reader, int n);
+int mfm_decode_word(unsigned word);
+void mfm_decode(unsigned char *out, const unsigned char *raw, int halfbit, int nbytes);
+void mfm_decode_scalar(unsigned char *out, const unsigned char *raw, int halfbit, int nbytes);
+int mfm_decode_select(const char *name);
+const char *mfm_decode_kernel(void);
+
+unsigned short mfm_crc16_byte(unsigned short sum, unsigned char byte);
+unsigned short mfm_crc16_ccitt(unsigned short sum, const unsigned char *buf, unsigned len);
+unsigned short mfm_crc16_mfm(unsigned short sum, const unsigned char *raw, int halfbit, int nbytes);
+int mfm_crc_select(const char *name);
+const char *mfm_crc_kernel(void);
+
+unsigned mfm_raw16(const unsigned char *data, int nhalfbits, int halfbit);
+int mfm_sync_search(const unsigned char *data, int nhalfbits, int from, int *sync);
+int mfm_sync_run(const unsigned char *data, int nhalfbits, int halfbit, int sync);
+int mfm_sync_mark(const unsigned char *data, int nhalfbits, int halfbit, int from, int count);
+int mfm_find_marks(const unsigned char *data, int nhalfbits, mfm_mark_t *marks, int maxmarks);
+
+/*
+ * Обработка одной дорожки. Ненулевое значение прекращает обход.
+ */
+typedef int mfm_track_func_t(mfm_reader_t *reader, void *arg);
+
+int mfm_for_each_track(mfm_image_t *img, int first, int last,
+    mfm_track_func_t *func, void *arg);
+int mfm_for_track_list(mfm_image_t *img, const int *tracks, int ntracks,
+    mfm_track_func_t *func, void *arg);
+int mfm_jobs_online(void);
+
+/*
+ * Кодирование одной дорожки.
+ */
+typedef void mfm_encode_func_t(mfm_writer_t *writer, int t, void *arg);
+
+void mfm_write_tracks(FILE *fout, int ntracks, mfm_encode_func_t *func, void *arg);
+void mfm_write_disk(FILE *fout, mfm_disk_t *d, mfm_encode_func_t *func, void *arg);
+
+/*
+ * Конвейер: чтение, обработка и запись дорожек в трёх потоках.
+ * Стадии передают друг другу MFM_PIPELINE_DEPTH ячеек.
+ */
+#define MFM_PIPELINE_DEPTH 8    /* степень двойки */
+
+typedef int mfm_stage_func_t(void *slot, int t, void *arg);
+
+int mfm_pipeline(void *slots, size_t slot_size, int ntracks,
+    mfm_stage_func_t *read, mfm_stage_func_t *work, mfm_stage_func_t *write,
+    void *arg);
+
+/*
+ * Потоковое извлечение: дорожка образа и её сектора.
+ */
+typedef struct {
+    mfm_reader_t reader;
+    mfm_track_data_t td;
+    int nsectors_per_track;     /* геометрия, с которой выдаём дорожку */
+    int size;
+} mfm_stream_slot_t;
+
+typedef void mfm_stream_func_t(mfm_stream_slot_t *slot, void *arg);
+
+void mfm_stream_tracks(mfm_image_t *img, int ntracks, FILE *fout,
+    mfm_stream_func_t *func, void *arg);
+
+void mfm_dump(mfm_image_t *img, int first, int last, int format);
+
+void mfm_stats_start(void);
+void mfm_stats_phase(const char *name);
+void mfm_stat_add(int c, long n);
+
+void mfm_trace_start(const char *filename);
+void mfm_trace_event(int type, int track, int arg1, int arg2);
+uint64_t mfm_trace_clock(void);
 
 void mfm_write_reset(mfm_writer_t *writer, FILE *fout);
 void mfm_write_halfbit(mfm_writer_t *writer, int val);
 void mfm_write_bit(mfm_writer_t *writer, int val);
 void mfm_write(mfm_writer_t *writer, unsigned char *data, int bytes);
+int mfm_encode(unsigned char *out, const unsigned char *data, int nbytes, int last);
 void mfm_write_byte(mfm_writer_t *writer, int val);
 void mfm_write_gap(mfm_writer_t *writer, int nbytes, int val);
 void mfm_fill_track(mfm_writer_t *writer, int val);
+void mfm_write_done(mfm_writer_t *writer);
+
+struct iovec;
+void *mfm_output_alloc(size_t nbytes);
+void mfm_output_write(FILE *fout, const void *buf, size_t nbytes);
+void mfm_output_writev(FILE *fout, struct iovec *iov, int iovcnt);
+void mfm_output_finish(FILE *fout);
 
-void mfm_analyze_ibmpc(FILE *fin, int ntracks);
-void mfm_read_ibmpc(mfm_disk_t *d, FILE *fin, int ntracks);
+mfm_template_t *mfm_template_find(const int *key);
+mfm_template_t *mfm_template_new(const int *key);
+void mfm_template_field(mfm_template_t *tpl, mfm_writer_t *writer, int nbytes);
+mfm_template_t *mfm_template_done(mfm_template_t *tpl, mfm_writer_t *writer);
+void mfm_template_begin(mfm_writer_t *writer, const mfm_template_t *tpl);
+void mfm_template_splice(mfm_writer_t *writer, const mfm_template_t *tpl,
+    int field, const unsigned char *data);
+void mfm_template_end(mfm_writer_t *writer);
+int mfm_is_zero(const unsigned char *data, int nbytes);
+
+mfm_disk_t *mfm_disk_alloc(int ntracks, int nsectors_per_track, int size);
+mfm_disk_t *mfm_disk_alloc_rows(int ntracks, int nsectors_per_track, int size, int nrows);
+void mfm_disk_free(mfm_disk_t *d);
+unsigned char *mfm_disk_sector(mfm_disk_t *d, int t, int s);
+void mfm_disk_put_track(mfm_disk_t *d, int t, mfm_track_data_t *td);
+void mfm_track_clear(mfm_track_data_t *td, int t);
+unsigned char *mfm_track_add(mfm_track_data_t *td, int s, int size, int bad_crc);
+unsigned char *mfm_track_sector(mfm_track_data_t *td, int s);
+int mfm_track_size(mfm_track_data_t *td);
+void mfm_write_raw_track(mfm_track_data_t *td, int nsectors_per_track, int size, FILE *fout);
+
+void mfm_analyze_ibmpc(mfm_image_t *img, int ntracks);
+mfm_disk_t *mfm_read_ibmpc(mfm_image_t *img, int ntracks);
+void mfm_stream_ibmpc(mfm_image_t *img, int ntracks, FILE *fout);
 void mfm_write_ibmpc(mfm_disk_t *d, FILE *fout, int skip_index_mark);
+int mfm_scan_ibmpc(mfm_reader_t *reader, int *nbits_read);
+int mfm_ibmpc_track_bytes(int nsectors, int size);
+
+mfm_index_t *mfm_index_open(mfm_image_t *img, const char *filename);
+void mfm_index_free(mfm_index_t *idx);
+int mfm_index_read_sector(mfm_index_t *idx, mfm_image_t *img,
+    int cylinder, int head, int sector, unsigned char *data, int *bad_crc);
+int mfm_index_write_sector(mfm_index_t *idx, mfm_image_t *img,
+    int cylinder, int head, int sector, const unsigned char *data, int nbytes);
+
+void mfm_detect(mfm_image_t *img, int nsample, mfm_detect_t *res);
+const char *mfm_format_name(int format);
 
-int mfm_detect_amiga(FILE *fin);
-void mfm_analyze_amiga(FILE *fin, int ntracks);
-void mfm_read_amiga(mfm_disk_t *d, FILE *fin, int ntracks);
+int mfm_detect_amiga(mfm_image_t *img);
+void mfm_analyze_amiga(mfm_image_t *img, int ntracks);
+mfm_disk_t *mfm_read_amiga(mfm_image_t *img, int ntracks);
+void mfm_stream_amiga(mfm_image_t *img, int ntracks, FILE *fout);
 void mfm_write_amiga(mfm_disk_t *d, FILE *fout);
+int mfm_scan_amiga(mfm_reader_t *reader, int *nbits_read);
+unsigned long mfm_amiga_unshuffle(int odd, int even);
+void mfm_amiga_shuffle(unsigned long word, int *odd, int *even);
+unsigned mfm_amiga_unshuffle_block(unsigned char *data, const unsigned char *raw);
+unsigned mfm_amiga_shuffle_block(unsigned char *raw, const unsigned char *data);
 
-void mfm_read_raw(mfm_disk_t *d, FILE *fin, int nsectors_per_track);
+mfm_disk_t *mfm_open_raw(FILE *fin, int nsectors_per_track, int size);
+int mfm_read_raw_track(mfm_disk_t *d, int t);
+mfm_disk_t *mfm_read_raw(FILE *fin, int nsectors_per_track, int size);
 void mfm_write_raw(mfm_disk_t *d, FILE *fout);
@@ -0,0 +1,149 @@
+/*
+ * Convert an mfmdisk trace into Chrome trace JSON.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "mfm.h"
+
+static void usage()
+{
+    fprintf(stderr, "Convert mfmdisk trace to Chrome trace JSON, version %s\n", PACKAGE_VERSION);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "    mfmtrace trace.bin > trace.json\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "The result can be viewed in chrome://tracing or ui.perfetto.dev.\n");
+    exit(-1);
+}
+
+/*
+ * Print the track as cylinder/head, or nothing when unknown.
+ */
+static void print_track(int track)
+{
+    if (track >= 0)
+        printf(" %d/%d", track >> 1, track & 1);
+}
+
+/*
+ * Timestamps in the trace are in nanoseconds,
+ * Chrome wants microseconds.
+ */
+static void print_event(const mfm_event_t *e, int *comma)
+{
+    double ts = e->time / 1000.0;
+
+    printf("%s\n{\"pid\":1,\"tid\":%u,", *comma ? "," : "", e->thread);
+    *comma = 1;
+    switch (e->type) {
+    case MFM_EV_TRACK_BEGIN:
+    case MFM_EV_TRACK_END:
+        printf("\"ts\":%.3f,\"ph\":\"%s\",\"cat\":\"track\",\"name\":\"track",
+            ts, e->type == MFM_EV_TRACK_BEGIN ? "B" : "E");
+        print_track(e->track);
+        printf("\"}");
+        break;
+    case MFM_EV_MARK:
+        printf("\"ts\":%.3f,\"ph\":\"i\",\"s\":\"t\",\"cat\":\"decode\",\"name\":\"mark\","
+            "\"args\":{\"track\":%d,\"halfbit\":%d,\"tag\":\"%02X\"}}",
+            ts, e->track, e->arg1, e->arg2 & 0xff);
+        break;
+    case MFM_EV_SECTOR:
+        printf("\"ts\":%.3f,\"ph\":\"i\",\"s\":\"t\",\"cat\":\"decode\",\"name\":\"sector%s\","
+            "\"args\":{\"track\":%d,\"sector\":%d,\"bad_crc\":%d}}",
+            ts, e->arg2 ? " bad crc" : "", e->track, e->arg1, e->arg2);
+        break;
+    case MFM_EV_PLL:
+        printf("\"ts\":%.3f,\"ph\":\"C\",\"cat\":\"pll\",\"name\":\"pll\","
+            "\"args\":{\"clock_ns\":%d,\"phase_ns\":%d}}",
+            ts, e->arg1, e->arg2);
+        break;
+    case MFM_EV_READ:
+    case MFM_EV_WRITE:
+        printf("\"ts\":%.3f,\"dur\":%.3f,\"ph\":\"X\",\"cat\":\"io\",\"name\":\"%s\","
+            "\"args\":{\"track\":%d,\"bytes\":%d}}",
+            ts - e->arg2 / 1000.0, e->arg2 / 1000.0,
+            e->type == MFM_EV_READ ? "read" : "write", e->track, e->arg1);
+        break;
+    default:
+        printf("\"ts\":%.3f,\"ph\":\"i\",\"s\":\"t\",\"name\":\"event %u\","
+            "\"args\":{\"track\":%d,\"arg1\":%d,\"arg2\":%d}}",
+            ts, e->type, e->track, e->arg1, e->arg2);
+        break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char magic [8];
+    uint32_t header [2];
+    mfm_event_t e;
+    int comma, maxthread;
+    FILE *fin;
+
+    if (argc != 2)
+        usage();
+    fin = fopen(argv[1], "rb");
+    if (! fin) {
+        perror(argv[1]);
+        exit(-1);
+    }
+    if (fread(magic, 1, 8, fin) != 8 || memcmp(magic, MFM_TRACE_MAGIC, 8) != 0 ||
+        fread(header, sizeof(header), 1, fin) != 1) {
+        fprintf(stderr, "%s: not an mfmdisk trace\n", argv[1]);
+        exit(-1);
+    }
+    if (header[0] != 1 || header[1] != sizeof(mfm_event_t)) {
+        fprintf(stderr, "%s: unsupported trace version %u\n", argv[1], header[0]);
+        exit(-1);
+    }
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    comma = 0;
+    maxthread = -1;
+    while (fread(&e, sizeof(e), 1, fin) == 1) {
+        print_event(&e, &comma);
+        if ((int) e.thread > maxthread)
+            maxthread = e.thread;
+    }
+
+    /* Name the threads: number 0 is the main thread. */
+    for (; maxthread >= 0; --maxthread) {
+        printf("%s\n{\"pid\":1,\"tid\":%d,\"ph\":\"M\",\"name\":\"thread_name\","
+            "\"args\":{\"name\":\"", comma ? "," : "", maxthread);
+        if (maxthread)
+            printf("worker %d\"}}", maxthread);
+        else
+            printf("main\"}}");
+        comma = 1;
+    }
+    printf("\n]}\n");
+    fclose(fin);
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Output of images: aligned buffers, vectored writes, O_DIRECT and fdatasync.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE             /* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "config.h"
+#include "mfm.h"
+
+#ifndef O_DIRECT
+#   define O_DIRECT 0
+#endif
+
+#define ALIGN   4096            /* buffer, offset and length unit for O_DIRECT */
+
+int mfm_direct;                 /* --direct: bypass the page cache */
+int mfm_sync;                   /* --sync: fdatasync() the output */
+
+/*
+ * Allocate an output buffer aligned for O_DIRECT.
+ */
+void *mfm_output_alloc(size_t nbytes)
+{
+    void *buf;
+
+    if (posix_memalign(&buf, ALIGN, (nbytes + ALIGN - 1) & ~(size_t) (ALIGN - 1)) != 0) {
+        fprintf(stderr, "Out of memory, aborted.\n");
+        exit(-1);
+    }
+    return buf;
+}
+
+/*
+ * Write all iovecs, at offset when it is not negative.
+ * The array is modified.
+ */
+static int writev_all(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+    ssize_t n;
+
+    for (;;) {
+        while (iovcnt > 0 && iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt == 0)
+            break;
+        if (offset >= 0)
+            n = pwritev(fd, iov, (iovcnt > IOV_MAX) ? IOV_MAX : iovcnt, offset);
+        else
+            n = writev(fd, iov, (iovcnt > IOV_MAX) ? IOV_MAX : iovcnt);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        if (offset >= 0)
+            offset += n;
+        while ((size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+            if (iovcnt == 0)
+                return 0;
+        }
+        iov->iov_base = (char*) iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+    return 0;
+}
+
+/*
+ * With --direct, write the aligned head of a single buffer
+ * bypassing the page cache.  Return the number of bytes written:
+ * 0 when the buffer, the offset or the file system does not allow
+ * it, and the rest goes through the page cache as usual.
+ */
+static size_t write_direct(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+    struct iovec iov;
+    size_t n = nbytes & ~(size_t) (ALIGN - 1);
+    int flags;
+
+    if (! mfm_direct || ! O_DIRECT || n == 0 || offset % ALIGN ||
+        (uintptr_t) buf % ALIGN)
+        return 0;
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0)
+        return 0;
+    iov.iov_base = (void*) buf;
+    iov.iov_len = n;
+    if (writev_all(fd, &iov, 1, offset) < 0)
+        n = 0;
+    fcntl(fd, F_SETFL, flags);
+    return n;
+}
+
+/*
+ * Write iovecs at the current position of the stream with one
+ * system call where possible, bypassing stdio.  A regular file
+ * is written with pwritev() and the stream is moved past the data.
+ */
+void mfm_output_writev(FILE *fout, struct iovec *iov, int iovcnt)
+{
+    struct stat st;
+    size_t nbytes = 0, done;
+    off_t offset = -1;
+    uint64_t t0;
+    int fd = fileno(fout), i;
+
+    for (i=0; i<iovcnt; ++i)
+        nbytes += iov[i].iov_len;
+    fflush(fout);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        offset = ftello(fout);
+
+    t0 = MFM_TRACE_CLOCK();
+    done = 0;
+    if (offset >= 0 && iovcnt == 1) {
+        done = write_direct(fd, iov->iov_base, nbytes, offset);
+        iov->iov_base = (char*) iov->iov_base + done;
+        iov->iov_len -= done;
+    }
+    if (writev_all(fd, iov, iovcnt, (offset >= 0) ? offset + (off_t) done : -1) < 0) {
+        perror("write");
+        exit(-1);
+    }
+    MFM_TRACE_IO(MFM_EV_WRITE, -1, nbytes, t0);
+    mfm_stat_add(MFM_STAT_BYTES_WRITTEN, nbytes);
+    if (offset >= 0)
+        fseeko(fout, offset + nbytes, SEEK_SET);
+}
+
+void mfm_output_write(FILE *fout, const void *buf, size_t nbytes)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*) buf;
+    iov.iov_len = nbytes;
+    mfm_output_writev(fout, &iov, 1);
+}
+
+/*
+ * The output is complete: with --sync, make sure the data
+ * is on the disk before returning.
+ */
+void mfm_output_finish(FILE *fout)
+{
+    fflush(fout);
+    if (mfm_sync && fdatasync(fileno(fout)) < 0 && errno != EINVAL) {
+        perror("fdatasync");
+        exit(-1);
+    }
+}
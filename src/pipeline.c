@@ -0,0 +1,293 @@
+/*
+ * Pipeline of read, decode and write stages for a stream of tracks.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "config.h"
+#include "mfm.h"
+
+#define CACHE_LINE      64
+
+/*
+ * Bounded queue of slots between two stages.  There is exactly
+ * one producer and one consumer, so passing a slot needs no lock:
+ * the producer owns head, the consumer owns tail, and each only
+ * reads the other's index.  A null slot marks the end of the stream.
+ * The lock and the condition are used only by a side which has
+ * nothing to do for a while, to sleep until the other side moves.
+ */
+typedef struct {
+    void *item [MFM_PIPELINE_DEPTH];
+    char pad1 [CACHE_LINE];
+    unsigned head;              /* written by the producer */
+    char pad2 [CACHE_LINE];
+    unsigned tail;              /* written by the consumer */
+    char pad3 [CACHE_LINE];
+    int waiting;                /* a side sleeps on moved */
+    pthread_mutex_t lock;
+    pthread_cond_t moved;
+} ring_t;
+
+typedef struct {
+    unsigned char *slots;
+    size_t slot_size;
+    int ntracks;
+    mfm_stage_func_t *read;
+    mfm_stage_func_t *work;
+    mfm_stage_func_t *write;
+    void *arg;
+    FILE *err;                  /* diagnostics of the caller */
+    int last;                   /* last track of the stream */
+    int status;                 /* value returned by the stage which ended it */
+    int track [MFM_PIPELINE_DEPTH]; /* track in each slot */
+    ring_t free;                /* writer -> reader: empty slots */
+    ring_t loaded;              /* reader -> worker */
+    ring_t done;                /* worker -> writer */
+} pipeline_t;
+
+static int ring_full(ring_t *r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) -
+        __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == MFM_PIPELINE_DEPTH;
+}
+
+static int ring_empty(ring_t *r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) ==
+        __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Wait while the queue is blocked for this side: spin a little,
+ * then give up the processor, then sleep until the other side
+ * moves.  A stage waiting for a slow disk or pipe should not burn
+ * a core or wake up for nothing.
+ */
+static void ring_wait(ring_t *r, int (*blocked)(ring_t*))
+{
+    int spins;
+
+    for (spins=0; spins<128; ++spins) {
+        if (! blocked(r))
+            return;
+        if (spins >= 64)
+            sched_yield();
+    }
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    while (blocked(r))
+        pthread_cond_wait(&r->moved, &r->lock);
+    __atomic_store_n(&r->waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * Wake the other side if it sleeps.  The index has been stored
+ * before waiting is checked, and the sleeper sets waiting before
+ * checking the index, so one of them always sees the other.
+ */
+static void ring_wake(ring_t *r)
+{
+    if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_signal(&r->moved);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+static void ring_put(ring_t *r, void *item)
+{
+    unsigned head = r->head;
+
+    ring_wait(r, ring_full);
+    r->item[head % MFM_PIPELINE_DEPTH] = item;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+    ring_wake(r);
+}
+
+static void *ring_get(ring_t *r)
+{
+    unsigned tail = r->tail;
+    void *item;
+
+    ring_wait(r, ring_empty);
+    item = r->item[tail % MFM_PIPELINE_DEPTH];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+    ring_wake(r);
+    return item;
+}
+
+static void ring_init(ring_t *r)
+{
+    pthread_mutex_init(&r->lock, 0);
+    pthread_cond_init(&r->moved, 0);
+}
+
+static void ring_destroy(ring_t *r)
+{
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->moved);
+}
+
+static int *slot_track(pipeline_t *p, void *slot)
+{
+    return &p->track[((unsigned char*) slot - p->slots) / p->slot_size];
+}
+
+/*
+ * End the stream at track last and keep the status.
+ */
+static void stop(pipeline_t *p, int last, int status)
+{
+    int old = __atomic_load_n(&p->last, __ATOMIC_ACQUIRE);
+
+    while (last < old && ! __atomic_compare_exchange_n(&p->last, &old, last,
+        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        continue;
+    if (last <= old)
+        __atomic_store_n(&p->status, status, __ATOMIC_RELEASE);
+}
+
+static int wanted(pipeline_t *p, int t)
+{
+    return t <= __atomic_load_n(&p->last, __ATOMIC_ACQUIRE);
+}
+
+static void *reader(void *arg)
+{
+    pipeline_t *p = arg;
+    void *slot;
+    int t, status;
+
+    mfm_err = p->err;
+    for (t=0; t<p->ntracks; ++t) {
+        slot = ring_get(&p->free);
+        if (! wanted(p, t))
+            break;
+        *slot_track(p, slot) = t;
+        status = p->read(slot, t, p->arg);
+        if (status) {
+            stop(p, t - 1, status);
+            break;
+        }
+        ring_put(&p->loaded, slot);
+    }
+    ring_put(&p->loaded, 0);
+    return 0;
+}
+
+static void *writer(void *arg)
+{
+    pipeline_t *p = arg;
+    void *slot;
+    int t, status;
+
+    mfm_err = p->err;
+    while ((slot = ring_get(&p->done)) != 0) {
+        t = *slot_track(p, slot);
+        if (wanted(p, t)) {
+            status = p->write(slot, t, p->arg);
+            if (status)
+                stop(p, t, status);
+        }
+        ring_put(&p->free, slot);
+    }
+    return 0;
+}
+
+/*
+ * Run tracks 0...ntracks-1 through three stages: read() in its own
+ * thread, work() in the calling thread and write() in a third one.
+ * The stages pass MFM_PIPELINE_DEPTH slots of slot_size bytes,
+ * provided by the caller, to each other, so reading the next tracks
+ * and writing the previous ones overlap with the work on the current
+ * one, and a stage which runs ahead waits for a free slot.
+ * A nonzero value from work() or write() ends the stream after
+ * that track, a nonzero value from read() ends it before;
+ * the value is returned.
+ */
+int mfm_pipeline(void *slots, size_t slot_size, int ntracks,
+    mfm_stage_func_t *read, mfm_stage_func_t *work, mfm_stage_func_t *write,
+    void *arg)
+{
+    pthread_t read_thread, write_thread;
+    pipeline_t *p;
+    void *slot;
+    int status, t, i;
+
+    p = calloc(1, sizeof(pipeline_t));
+    if (! p) {
+        fprintf(stderr, "Out of memory, aborted.\n");
+        exit(-1);
+    }
+    p->slots = slots;
+    p->slot_size = slot_size;
+    p->ntracks = ntracks;
+    p->read = read;
+    p->work = work;
+    p->write = write;
+    p->arg = arg;
+    p->err = mfm_err;
+    p->last = ntracks - 1;
+    ring_init(&p->free);
+    ring_init(&p->loaded);
+    ring_init(&p->done);
+    for (i=0; i<MFM_PIPELINE_DEPTH; ++i)
+        ring_put(&p->free, p->slots + i * slot_size);
+
+    /* Select the kernels before starting threads. */
+    mfm_decode_kernel();
+    mfm_crc_kernel();
+
+    if (pthread_create(&read_thread, 0, reader, p) != 0 ||
+        pthread_create(&write_thread, 0, writer, p) != 0) {
+        perror("pthread_create");
+        exit(-1);
+    }
+    while ((slot = ring_get(&p->loaded)) != 0) {
+        t = *slot_track(p, slot);
+        if (wanted(p, t)) {
+            status = work(slot, t, arg);
+            if (status)
+                stop(p, t, status);
+        }
+        ring_put(&p->done, slot);
+    }
+    ring_put(&p->done, 0);
+    pthread_join(read_thread, 0);
+    pthread_join(write_thread, 0);
+
+    status = p->status;
+    ring_destroy(&p->free);
+    ring_destroy(&p->loaded);
+    ring_destroy(&p->done);
+    free(p);
+    return status;
+}
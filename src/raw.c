@@ -27,50 +27,171 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include "config.h"
 #include "mfm.h"
 
 /*
- * Чтение образа дискеты из файла в традиционном бинарном виде.
+ * Геометрия из BPB загрузочного сектора MS-DOS: размер сектора,
+ * секторов на дорожке и всего секторов.  Возвращаем 0, если
+ * BPB нет или он не похож на дискету.
  */
-void mfm_read_raw(mfm_disk_t *d, FILE *fin, int nsectors_per_track)
+static int parse_bpb(const unsigned char *boot, int *nsectors_per_track,
+    int *size, int *ntracks)
 {
-    int t, s;
+    unsigned bytes, nsect, nheads, total;
+    int code;
+
+    bytes = boot[11] | boot[12] << 8;
+    nsect = boot[24] | boot[25] << 8;
+    nheads = boot[26] | boot[27] << 8;
+    total = boot[19] | boot[20] << 8;
+    if (total == 0)
+        total = boot[32] | boot[33] << 8 | boot[34] << 16 | (unsigned) boot[35] << 24;
+
+    for (code=0; code<=MAXSIZE; ++code)
+        if ((128u << code) == bytes)
+            break;
+    if (code > MAXSIZE || nsect < 1 || nsect > MAXSECT ||
+        nheads < 1 || nheads > 2 || total == 0 || total % nsect != 0 ||
+        total / nsect > MAXTRACK || nsect * bytes < SECTSZ)
+        return 0;
+    *nsectors_per_track = nsect;
+    *size = code;
+    *ntracks = total / nsect;
+    return 1;
+}
+
+/*
+ * Чтение образа дискеты из файла в традиционном бинарном виде
+ * целиком, одним вызовом.  Количество дорожек определяем
+ * по размеру файла.
+ */
+mfm_disk_t *mfm_read_raw(FILE *fin, int nsectors_per_track, int size)
+{
+    mfm_disk_t *d;
     struct stat st;
+    size_t nbytes;
+    uint64_t t0;
+    int ntracks;
 
     if (fstat(fileno(fin), &st) < 0) {
         fprintf(mfm_err, "Cannot fstat() input file, aborted.\n");
         exit(-1);
     }
-    d->ntracks = st.st_size / SECTSZ / nsectors_per_track;
-    d->nsectors_per_track = nsectors_per_track;
-    if (d->ntracks > MAXTRACK) {
+    ntracks = st.st_size / (128 << size) / nsectors_per_track;
+    if (ntracks > MAXTRACK) {
         fprintf(mfm_err, "Too many tracks = %d, aborted.\n",
-            d->ntracks);
+            ntracks);
         exit(-1);
     }
+    d = mfm_disk_alloc(ntracks, nsectors_per_track, size);
     fseek(fin, 0L, SEEK_SET);
-    for (t=0; t<d->ntracks; ++t) {
-        for (s=0; s<d->nsectors_per_track; ++s) {
-            if (fread(d->block[t][s], SECTSZ, 1, fin) != 1) {
-                fprintf(mfm_err, "Error reading input file, aborted.\n");
+    nbytes = (size_t) d->sector_bytes * nsectors_per_track * ntracks;
+    t0 = MFM_TRACE_CLOCK();
+    if (fread(d->data, 1, nbytes, fin) != nbytes) {
+        fprintf(mfm_err, "Error reading input file, aborted.\n");
+        exit(-1);
+    }
+    MFM_TRACE_IO(MFM_EV_READ, -1, nbytes, t0);
+    mfm_stat_add(MFM_STAT_BYTES_READ, nbytes);
+    return d;
+}
+
+/*
+ * Открытие образа дискеты в традиционном бинарном виде.
+ * Размер сектора задаётся кодом size: 128 << size байт.
+ * Обычный файл читаем целиком, mfm_read_raw().
+ *
+ * Из канала размер не узнать: дорожки читаем до конца данных,
+ * по одной, mfm_read_raw_track(), а в памяти держим только те,
+ * что в работе.  Если геометрия не задана (nsectors_per_track
+ * равно 0), берём её из BPB загрузочного сектора.
+ */
+mfm_disk_t *mfm_open_raw(FILE *fin, int nsectors_per_track, int size)
+{
+    unsigned char boot [SECTSZ];
+    mfm_disk_t *d;
+    struct stat st;
+    int ntracks, nbytes;
+
+    if (fstat(fileno(fin), &st) < 0) {
+        fprintf(mfm_err, "Cannot fstat() input file, aborted.\n");
+        exit(-1);
+    }
+    if (S_ISREG(st.st_mode))
+        return mfm_read_raw(fin, nsectors_per_track ? nsectors_per_track : 9, size);
+
+    /* Поток. */
+    ntracks = MAXTRACK;
+    nbytes = 0;
+    if (! nsectors_per_track) {
+        nbytes = fread(boot, 1, SECTSZ, fin);
+        if (nbytes == SECTSZ &&
+            parse_bpb(boot, &nsectors_per_track, &size, &ntracks)) {
+            if (mfm_verbose)
+                fprintf(mfm_err, "Boot sector: %d tracks, %d sectors per track, %d bytes per sector\n",
+                    ntracks, nsectors_per_track, 128 << size);
+
+            /* Дискеты высокой плотности на дорожку MFM не помещаются. */
+            if (mfm_ibmpc_track_bytes(nsectors_per_track, size) > TRACKSZ / 2) {
+                fprintf(mfm_err, "Boot sector: %d sectors of %d bytes do not fit in a track, aborted.\n",
+                    nsectors_per_track, 128 << size);
                 exit(-1);
             }
-        }
+        } else
+            nsectors_per_track = 9;
     }
+    d = mfm_disk_alloc_rows(ntracks, nsectors_per_track, size, MFM_PIPELINE_DEPTH);
+    if (nbytes > d->sector_bytes * nsectors_per_track) {
+        fprintf(mfm_err, "Track is shorter than boot sector, aborted.\n");
+        exit(-1);
+    }
+    memcpy(mfm_disk_sector(d, 0, 0), boot, nbytes);
+    d->prefetched = nbytes;
+    d->fin = fin;
+    return d;
 }
 
 /*
- * Запись образа дискеты в файл в традиционном бинарном виде.
+ * Чтение секторов дорожки t, по порядку.
+ * Возвращаем -1, если данные кончились: неполная
+ * последняя дорожка отбрасывается.
  */
-void mfm_write_raw(mfm_disk_t *d, FILE *fout)
+int mfm_read_raw_track(mfm_disk_t *d, int t)
 {
-    int t, s;
+    size_t nbytes = (size_t) d->sector_bytes * d->nsectors_per_track;
+    size_t done = (t == 0) ? d->prefetched : 0;
+    unsigned char *data = mfm_disk_sector(d, t, 0);
+    uint64_t t0;
 
-    for (t=0; t<d->ntracks; ++t) {
-        for (s=0; s<d->nsectors_per_track; ++s) {
-            fwrite(d->block[t][s], SECTSZ, 1, fout);
-        }
+    t0 = MFM_TRACE_CLOCK();
+    done += fread(data + done, 1, nbytes - done, d->fin);
+    MFM_TRACE_IO(MFM_EV_READ, t, done, t0);
+    mfm_stat_add(MFM_STAT_BYTES_READ, done);
+    if (done == nbytes) {
+        if (t == d->ntracks - 1 && d->nrows < d->ntracks &&
+            getc(d->fin) != EOF)
+            fprintf(mfm_err, "Input is longer than %d tracks, the rest is ignored\n",
+                d->ntracks);
+        return 0;
     }
+    if (ferror(d->fin)) {
+        fprintf(mfm_err, "Error reading input file, aborted.\n");
+        exit(-1);
+    }
+    if (done > 0)
+        fprintf(mfm_err, "Track %d: incomplete, %d bytes ignored\n",
+            t, (int) done);
+    return -1;
+}
+
+/*
+ * Запись образа дискеты в файл в традиционном бинарном виде.
+ */
+void mfm_write_raw(mfm_disk_t *d, FILE *fout)
+{
+    mfm_output_write(fout, d->data,
+        (size_t) d->sector_bytes * d->ntracks * d->nsectors_per_track);
 }
@@ -48,14 +48,18 @@ static void read_exact(int fd, void *buf, size_t count)
 {
     ssize_t done;
     char *_buf = buf;
+    uint64_t t0;
 
     while (count > 0) {
+        t0 = MFM_TRACE_CLOCK();
         done = read(fd, _buf, count);
         if (done < 0) {
             if ((errno == EAGAIN) || (errno == EINTR))
                 continue;
             err(1, NULL);
         }
+        MFM_TRACE_IO(MFM_EV_READ, -1, done, t0);
+        mfm_stat_add(MFM_STAT_BYTES_READ, done);
         if (done == 0) {
             memset(_buf, 0, count);
             done = count;
@@ -282,19 +286,10 @@ void scp_print_track(scp_file_t *sf)
 #define PERIOD_ADJ_PCT  5
 #define PHASE_ADJ_PCT   60
 
-typedef struct {
-    scp_file_t *sf;
-    int rev;
-    int clock;          /* nsec */
-    int flux;           /* nsec */
-    int time;           /* nsec */
-    int clocked_zeros;
-} pll_t;
-
 /*
  * Initialize PLL.
  */
-static void pll_init(pll_t *pll, scp_file_t *sf, int rev)
+void scp_pll_init(scp_pll_t *pll, scp_file_t *sf, int rev)
 {
     memset(pll, 0, sizeof(*pll));
     pll->sf = sf;
@@ -307,7 +302,7 @@ static void pll_init(pll_t *pll, scp_file_t *sf, int rev)
  * Implement PLL in software.
  * The routine was ported from keirf/Disk-Utilities project.
  */
-static int pll_next_bit(pll_t *pll)
+int scp_pll_next_bit(scp_pll_t *pll)
 {
     while (pll->flux < pll->clock/2) {
         pll->flux += 25 * scp_next_flux(pll->sf, pll->rev);
@@ -329,6 +324,7 @@ static int pll_next_bit(pll_t *pll)
         pll->clock += pll->flux * PERIOD_ADJ_PCT / 100;
     } else {
         /* Out of sync: adjust base clock towards centre. */
+        mfm_stat_add(MFM_STAT_PLL_UNSYNC, 1);
         pll->clock += (CLOCK_CENTRE - pll->clock) * PERIOD_ADJ_PCT / 100;
     }
 
@@ -338,6 +334,10 @@ static int pll_next_bit(pll_t *pll)
     if (pll->clock > CLOCK_MAX(CLOCK_CENTRE))
         pll->clock = CLOCK_MAX(CLOCK_CENTRE);
 
+    /* Trace every resync, and a sample of in-sync adjustments. */
+    if (pll->clocked_zeros > 3 || (pll->nadjust++ & 255) == 0)
+        MFM_TRACE(MFM_EV_PLL, pll->sf->track.track_nr, pll->clock, pll->flux);
+
     /* PLL: Adjust clock phase according to mismatch.
      * eg. PHASE_ADJ_PCT=100% -> timing window snaps to observed flux. */
     int new_flux = pll->flux * (100 - PHASE_ADJ_PCT) / 100;
@@ -348,6 +348,86 @@ static int pll_next_bit(pll_t *pll)
     return 1;
 }
 
+/*
+ * SCP to MFM conversion is a pipeline: the flux of the next tracks
+ * is read while the current one goes through the PLL, and the
+ * previous ones are written out.  Each slot has its own copy
+ * of the file state, with the flux data of its track.
+ */
+typedef struct {
+    scp_file_t sf;
+    int present;                /* track is in the file */
+    mfm_writer_t writer;
+} scp_slot_t;
+
+typedef struct {
+    scp_file_t *sf;
+    FILE *fout;
+    int rev;
+} scp_pipe_t;
+
+static int scp_read_stage(void *slot, int tn, void *arg)
+{
+    scp_pipe_t *sp = arg;
+    scp_slot_t *ss = slot;
+
+    ss->sf.fd = sp->sf->fd;
+    ss->sf.header = sp->sf->header;
+    ss->present = tn >= sp->sf->header.start_track &&
+                  tn < sp->sf->header.end_track &&
+                  scp_select_track(&ss->sf, tn) >= 0;
+    return 0;
+}
+
+static int scp_decode_stage(void *slot, int tn, void *arg)
+{
+    scp_pipe_t *sp = arg;
+    scp_slot_t *ss = slot;
+    mfm_writer_t *writer = &ss->writer;
+    int n;
+
+    /* Start new track. */
+    MFM_TRACE(MFM_EV_TRACK_BEGIN, tn, 0, 0);
+    mfm_write_reset(writer, 0);
+
+    if (! ss->present) {
+        /* Produce empty track. */
+        for (n=0; n<6400; n++)
+            mfm_write_byte(writer, 0);
+    } else {
+        /* Decode flux data of this revolution. */
+        scp_pll_t pll;
+
+        scp_reset(&ss->sf);
+        scp_pll_init(&pll, &ss->sf, sp->rev);
+        scp_pll_next_bit(&pll); /* Ignore first half-bit. */
+        n = 0;
+        do {
+            int halfbit = scp_pll_next_bit(&pll);
+            mfm_write_halfbit(writer, halfbit);
+            n++;
+        } while (ss->sf.iter_ptr < ss->sf.iter_limit);
+
+        /* Fill the rest of track. */
+        while (n++ < 12800*8) {
+            mfm_write_halfbit(writer, !writer->last);
+            if (n++ < 12800*8)
+                mfm_write_halfbit(writer, !writer->last);
+        }
+    }
+    MFM_TRACE(MFM_EV_TRACK_END, tn, 0, 0);
+    return 0;
+}
+
+static int scp_write_stage(void *slot, int tn, void *arg)
+{
+    scp_pipe_t *sp = arg;
+    scp_slot_t *ss = slot;
+
+    mfm_output_write(sp->fout, ss->writer.buf, TRACKSZ);
+    return 0;
+}
+
 /*
  * Decode MFM data from SCP file, for given revolution.
  */
@@ -357,46 +437,23 @@ void scp_write_mfm(const char *name, FILE *fout, int rev)
     scp_file_t sf;
     scp_open(&sf, name);
 
-    mfm_writer_t writer;
-
     if (rev >= sf.header.nr_revolutions)
         errx(1, "Revolution %d out of range 0...%d\n", rev, sf.header.nr_revolutions-1);
 
-    int tn;
-    for (tn = 0; tn < 160; tn++) {
-        int n;
-
-        /* Start new track. */
-        mfm_write_reset(&writer, fout);
-
-        if (tn < sf.header.start_track ||
-            tn >= sf.header.end_track ||
-            scp_select_track(&sf, tn) < 0)
-        {
-            /* Produce empty track. */
-            for (n=0; n<6400; n++)
-                mfm_write_byte(&writer, 0);
-        } else {
-            /* Decode flux data of this revolution. */
-            pll_t pll;
-
-            scp_reset(&sf);
-            pll_init(&pll, &sf, rev);
-            pll_next_bit(&pll); /* Ignore first half-bit. */
-            n = 0;
-            do {
-                int halfbit = pll_next_bit(&pll);
-                mfm_write_halfbit(&writer, halfbit);
-                n++;
-            } while (sf.iter_ptr < sf.iter_limit);
-
-            /* Fill the rest of track. */
-            while (n++ < 12800*8) {
-                mfm_write_halfbit(&writer, !writer.last);
-                if (n++ < 12800*8)
-                    mfm_write_halfbit(&writer, !writer.last);
-            }
-        }
-    }
+    scp_slot_t *slots = calloc(MFM_PIPELINE_DEPTH, sizeof(scp_slot_t));
+    if (! slots)
+        err(1, NULL);
+
+    scp_pipe_t sp;
+    sp.sf = &sf;
+    sp.fout = fout;
+    sp.rev = rev;
+    mfm_pipeline(slots, sizeof(scp_slot_t), 160,
+        scp_read_stage, scp_decode_stage, scp_write_stage, &sp);
+
+    int i;
+    for (i = 0; i < MFM_PIPELINE_DEPTH; i++)
+        free(slots[i].sf.dat);
+    free(slots);
     scp_close(&sf);
 }
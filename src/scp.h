@@ -197,11 +197,26 @@ typedef struct {
 
 } scp_file_t;
 
+/*
+ * Software PLL for decoding flux data.
+ */
+typedef struct {
+    scp_file_t *sf;
+    int rev;
+    int clock;          /* nsec */
+    int flux;           /* nsec */
+    int time;           /* nsec */
+    int clocked_zeros;
+    unsigned nadjust;   /* clock adjustments, for tracing */
+} scp_pll_t;
+
 int scp_open(scp_file_t *sf, const char *name);
 void scp_close(scp_file_t *sf);
 int scp_select_track(scp_file_t *sf, unsigned int tracknr);
 void scp_reset(scp_file_t *sf);
 unsigned scp_next_flux(scp_file_t *sf, unsigned int data_rpm);
+void scp_pll_init(scp_pll_t *pll, scp_file_t *sf, int rev);
+int scp_pll_next_bit(scp_pll_t *pll);
 void scp_print_disk_header(scp_file_t *sf);
 void scp_print_track(scp_file_t *sf);
 void scp_generate_vcd(scp_file_t *sf, const char *name);
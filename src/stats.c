@@ -0,0 +1,151 @@
+/*
+ * Run statistics in JSON form.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "config.h"
+#include "mfm.h"
+
+#define MAXPHASES 8
+
+static const char *counter_name [MFM_NSTATS] = {
+    "tracks_read",
+    "tracks_written",
+    "sync_marks",
+    "header_crc_errors",
+    "data_crc_errors",
+    "missing_sectors",
+    "pll_out_of_sync",
+    "bytes_read",
+    "bytes_written",
+};
+
+int mfm_stats;                  /* --stats: collect the counters */
+
+static long counter [MFM_NSTATS];
+
+static struct {
+    const char *name;
+    double wall;
+    double cpu;
+} phase [MAXPHASES];
+
+static int nphases;
+static double start_wall, start_cpu;    /* whole run */
+static double phase_wall, phase_cpu;    /* current phase */
+
+static double wall_time()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * CPU time of all threads of the process.
+ */
+static double cpu_time()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+/*
+ * Add n to a counter.  Safe to call from worker threads.
+ */
+void mfm_stat_add(int c, long n)
+{
+    if (mfm_stats)
+        __sync_fetch_and_add(&counter[c], n);
+}
+
+/*
+ * Finish the current phase, if any, and start a new one.
+ * With name 0 just finish the current phase.
+ */
+void mfm_stats_phase(const char *name)
+{
+    double wall, cpu;
+
+    if (! mfm_stats)
+        return;
+    wall = wall_time();
+    cpu = cpu_time();
+    if (nphases > 0 && phase[nphases-1].wall < 0) {
+        phase[nphases-1].wall = wall - phase_wall;
+        phase[nphases-1].cpu = cpu - phase_cpu;
+    }
+    if (! name || nphases >= MAXPHASES)
+        return;
+    phase[nphases].name = name;
+    phase[nphases].wall = -1;
+    nphases++;
+    phase_wall = wall;
+    phase_cpu = cpu;
+}
+
+/*
+ * Print statistics as one JSON object on stderr.
+ */
+static void stats_print()
+{
+    double wall, cpu;
+    int i;
+
+    mfm_stats_phase(0);
+    wall = wall_time() - start_wall;
+    cpu = cpu_time() - start_cpu;
+    fprintf(stderr, "{\"version\":\"%s\",\"jobs\":%d",
+        PACKAGE_VERSION, mfm_jobs > 1 ? mfm_jobs : 1);
+    for (i=0; i<MFM_NSTATS; ++i)
+        fprintf(stderr, ",\"%s\":%ld", counter_name[i], counter[i]);
+    fprintf(stderr, ",\"wall\":%.6f,\"cpu\":%.6f,\"phases\":[", wall, cpu);
+    for (i=0; i<nphases; ++i)
+        fprintf(stderr, "%s{\"name\":\"%s\",\"wall\":%.6f,\"cpu\":%.6f}",
+            i ? "," : "", phase[i].name, phase[i].wall, phase[i].cpu);
+    fprintf(stderr, "]}\n");
+}
+
+/*
+ * Enable statistics; they are printed when the program exits.
+ */
+void mfm_stats_start()
+{
+    if (mfm_stats)
+        return;
+    mfm_stats = 1;
+    start_wall = wall_time();
+    start_cpu = cpu_time();
+    atexit(stats_print);
+}
@@ -0,0 +1,197 @@
+/*
+ * Search for sync marks in MFM track data.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include "config.h"
+#include "mfm.h"
+
+/*
+ * Load 64 halfbits starting at byte pos.
+ * Bytes past the end of the track read as zeros.
+ */
+static inline uint64_t load_word(const unsigned char *data, int nbytes, int pos)
+{
+    const unsigned char *p = data + pos;
+    uint64_t word;
+    int i;
+
+    if (pos >= 0 && pos + 8 <= nbytes) {
+        return (uint64_t) p[0] << 56 | (uint64_t) p[1] << 48 |
+               (uint64_t) p[2] << 40 | (uint64_t) p[3] << 32 |
+               (uint64_t) p[4] << 24 | (uint64_t) p[5] << 16 |
+               (uint64_t) p[6] << 8  | p[7];
+    }
+    word = 0;
+    for (i=0; i<8; ++i) {
+        word <<= 8;
+        if (pos + i >= 0 && pos + i < nbytes)
+            word |= p[i];
+    }
+    return word;
+}
+
+/*
+ * Compare a 16-bit pattern against every offset of a 64-bit word at once.
+ * Bit (63 - s) of the result is set when the pattern starts at offset s.
+ * Only offsets 0...48 are meaningful.
+ */
+static inline uint64_t match16(uint64_t word, unsigned pattern)
+{
+    uint64_t match = ~0ULL;
+    int j;
+
+    for (j=0; j<16; ++j) {
+        if (pattern >> (15 - j) & 1)
+            match &= word << j;
+        else
+            match &= ~(word << j);
+    }
+    return match;
+}
+
+/*
+ * Get 16 halfbits at any offset, including negative ones
+ * and those past the end of the track, which read as zeros.
+ */
+unsigned mfm_raw16(const unsigned char *data, int nhalfbits, int halfbit)
+{
+    int pos = halfbit >> 3;
+
+    if (halfbit < 0)
+        pos = -((7 - halfbit) >> 3);
+    return load_word(data, (nhalfbits + 7) >> 3, pos) << (halfbit - pos*8) >> 48;
+}
+
+/*
+ * Find the next sync word (A1 or C2 with a missing clock bit)
+ * at or after the given halfbit.  Both halfbit phases are searched
+ * together, 48 offsets per step.  For C2 both the standard word
+ * and the one produced by mfm_write_ibmpc() are recognized.
+ * Return the halfbit offset of the word and store the word itself,
+ * or return -1 when there is none up to the end of the track.
+ */
+int mfm_sync_search(const unsigned char *data, int nhalfbits, int from, int *sync)
+{
+    int nbytes = (nhalfbits + 7) >> 3;
+    int pos, skip, s, halfbit;
+    uint64_t word, a1, c2, hits;
+
+    if (from < 0)
+        from = 0;
+    pos = from >> 3;
+    skip = from & 7;
+    while (pos*8 + skip + 16 <= nhalfbits) {
+        word = load_word(data, nbytes, pos);
+        a1 = match16(word, MFM_SYNC_A1);
+        c2 = match16(word, MFM_SYNC_C2) | match16(word, MFM_SYNC_C2_ALT);
+        hits = (a1 | c2) & (~0ULL << 16) & (~0ULL >> skip);
+        if (hits) {
+            s = __builtin_clzll(hits);
+            halfbit = pos*8 + s;
+            if (halfbit + 16 > nhalfbits)
+                return -1;
+            if (sync)
+                *sync = mfm_raw16(data, nhalfbits, halfbit);
+            return halfbit;
+        }
+        pos += 6;
+        skip = 0;
+    }
+    return -1;
+}
+
+/*
+ * Count identical sync words following each other from the given halfbit.
+ */
+int mfm_sync_run(const unsigned char *data, int nhalfbits, int halfbit, int sync)
+{
+    int count = 0;
+
+    while (halfbit + 16 <= nhalfbits &&
+           mfm_raw16(data, nhalfbits, halfbit) == (unsigned) sync) {
+        count++;
+        halfbit += 16;
+    }
+    return count;
+}
+
+/*
+ * Confirm a mark around the sync word found at halfbit:
+ * a zero byte and then count bytes equal to the decoded sync word.
+ * Only data bits are compared, as the bit-serial scan did, so
+ * a word with a damaged clock bit still counts as long as another
+ * word of the mark matched exactly.  The zero byte must lie at or
+ * after from; halfbits before the track read as zeros.
+ * Return the halfbit offset of the first word of the mark, or -1.
+ */
+int mfm_sync_mark(const unsigned char *data, int nhalfbits, int halfbit,
+    int from, int count)
+{
+    int byte, start, i;
+
+    byte = mfm_decode_word(mfm_raw16(data, nhalfbits, halfbit));
+    for (start = halfbit - 16*(count-1); start <= halfbit; start += 16) {
+        if (start - 16 < from || start + 16*count > nhalfbits)
+            continue;
+        if (mfm_decode_word(mfm_raw16(data, nhalfbits, start - 16)) != 0)
+            continue;
+        for (i=0; i<count; ++i)
+            if (mfm_decode_word(mfm_raw16(data, nhalfbits, start + 16*i)) != byte)
+                break;
+        if (i == count)
+            return start;
+    }
+    return -1;
+}
+
+/*
+ * Find all marks on a track in one pass.  A mark is a run
+ * of identical sync words.  Up to maxmarks entries are stored;
+ * the total number of marks found is returned.
+ */
+int mfm_find_marks(const unsigned char *data, int nhalfbits,
+    mfm_mark_t *marks, int maxmarks)
+{
+    int halfbit, sync, count, n;
+
+    n = 0;
+    halfbit = 0;
+    for (;;) {
+        halfbit = mfm_sync_search(data, nhalfbits, halfbit, &sync);
+        if (halfbit < 0)
+            break;
+        count = mfm_sync_run(data, nhalfbits, halfbit, sync);
+        if (n < maxmarks) {
+            marks[n].halfbit = halfbit;
+            marks[n].sync = sync;
+            marks[n].count = count;
+        }
+        n++;
+        halfbit += 16 * count;
+    }
+    return n;
+}
@@ -0,0 +1,182 @@
+/*
+ * Track templates: encoded skeletons of tracks with splice points.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "config.h"
+#include "mfm.h"
+
+/*
+ * Templates built so far, for any format and geometry.
+ * They live until the program exits.
+ */
+static mfm_template_t *cache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Find the template for the given key, or 0.
+ */
+mfm_template_t *mfm_template_find(const int *key)
+{
+    mfm_template_t *tpl;
+
+    pthread_mutex_lock(&cache_lock);
+    for (tpl=cache; tpl; tpl=tpl->next)
+        if (memcmp(tpl->key, key, sizeof(tpl->key)) == 0)
+            break;
+    pthread_mutex_unlock(&cache_lock);
+    return tpl;
+}
+
+/*
+ * Start building a template: the caller encodes one track
+ * with the writer, calling mfm_template_field() where a field
+ * begins, and then mfm_template_done().
+ */
+mfm_template_t *mfm_template_new(const int *key)
+{
+    mfm_template_t *tpl;
+
+    tpl = calloc(1, sizeof(mfm_template_t));
+    if (! tpl) {
+        fprintf(stderr, "Out of memory, aborted.\n");
+        exit(-1);
+    }
+    memcpy(tpl->key, key, sizeof(tpl->key));
+    tpl->valid = 1;
+    return tpl;
+}
+
+/*
+ * A field of nbytes data bytes starts at the current position
+ * of the writer.  Fields must be byte-aligned in the track.
+ */
+void mfm_template_field(mfm_template_t *tpl, mfm_writer_t *writer, int nbytes)
+{
+    int offset = writer->halfbit >> 3;
+
+    if (! tpl)
+        return;
+    if (tpl->nfields >= MFM_TEMPLATE_FIELDS || (writer->halfbit & 7) ||
+        offset == 0 || offset + 2*nbytes > TRACKSZ) {
+        tpl->valid = 0;
+        return;
+    }
+    tpl->offset[tpl->nfields] = offset;
+    tpl->nbytes[tpl->nfields] = nbytes;
+    tpl->nfields++;
+}
+
+/*
+ * The track is complete: keep its contents and add the template
+ * to the cache.  A template with a field that did not fit into
+ * the track is kept too, so that the check is not repeated,
+ * but it is never used.
+ */
+mfm_template_t *mfm_template_done(mfm_template_t *tpl, mfm_writer_t *writer)
+{
+    mfm_template_t *old;
+
+    memcpy(tpl->raw, writer->buf, TRACKSZ);
+    if (writer->halfbit != 102400)
+        tpl->valid = 0;
+    else
+        mfm_stat_add(MFM_STAT_TRACKS_WRITTEN, -1);  /* not part of the output */
+
+    pthread_mutex_lock(&cache_lock);
+    for (old=cache; old; old=old->next)
+        if (memcmp(old->key, tpl->key, sizeof(tpl->key)) == 0)
+            break;
+    if (old) {
+        /* Built by another thread meanwhile. */
+        free(tpl);
+        tpl = old;
+    } else {
+        tpl->next = cache;
+        cache = tpl;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return tpl;
+}
+
+/*
+ * Start a track from the template.
+ */
+void mfm_template_begin(mfm_writer_t *writer, const mfm_template_t *tpl)
+{
+    memcpy(writer->buf, tpl->raw, TRACKSZ);
+}
+
+/*
+ * Encode new contents of a field into the track.  The first clock
+ * bit follows the last bit before the field, and the clock bit
+ * of the cell after it is fixed up for the new last bit.
+ * Fields must be spliced in track order.
+ */
+void mfm_template_splice(mfm_writer_t *writer, const mfm_template_t *tpl,
+    int field, const unsigned char *data)
+{
+    unsigned char *raw = writer->buf + tpl->offset[field];
+    int end = tpl->offset[field] + 2 * tpl->nbytes[field];
+    int last;
+
+    last = mfm_encode(raw, data, tpl->nbytes[field], raw[-1] & 1);
+    if (end < TRACKSZ) {
+        if (! last && ! (writer->buf[end] & 0x40))
+            writer->buf[end] |= 0x80;
+        else
+            writer->buf[end] &= ~0x80;
+    }
+}
+
+/*
+ * The track is complete.
+ */
+void mfm_template_end(mfm_writer_t *writer)
+{
+    mfm_write_done(writer);
+}
+
+/*
+ * Check whether a block is all zeros, as in a blank disk:
+ * such a field is left as the template has it.
+ */
+int mfm_is_zero(const unsigned char *data, int nbytes)
+{
+    uint64_t word, acc = 0;
+    int i;
+
+    for (i=0; i+8<=nbytes; i+=8) {
+        memcpy(&word, data + i, 8);
+        acc |= word;
+    }
+    for (; i<nbytes; ++i)
+        acc |= data[i];
+    return acc == 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Event tracing into per-thread ring buffers.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include "config.h"
+#include "mfm.h"
+
+/*
+ * Every thread records events into its own ring, so recording
+ * needs no locking.  When a ring is full the oldest events
+ * are overwritten.  Rings are never freed: they stay in the list
+ * until the trace is written on exit or on a fatal signal.
+ */
+#define RING_EVENTS 65536       /* per thread, a power of two */
+
+typedef struct ring {
+    struct ring *next;
+    int thread;                 /* thread number, from 0 */
+    unsigned count;             /* events recorded */
+    mfm_event_t event [RING_EVENTS];
+} ring_t;
+
+int mfm_tracing;                /* --trace: record events */
+
+static __thread ring_t *ring;
+static ring_t *rings;           /* all rings */
+static int nrings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *trace_filename;
+static uint64_t start_time;
+static volatile sig_atomic_t written;
+
+static const int fatal_signals[] = { SIGINT, SIGTERM, SIGHUP, SIGSEGV, SIGBUS, SIGABRT };
+
+static uint64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Time in nanoseconds since the trace was started.
+ */
+uint64_t mfm_trace_clock()
+{
+    return now() - start_time;
+}
+
+static ring_t *new_ring()
+{
+    ring_t *r = calloc(1, sizeof(ring_t));
+
+    if (! r)
+        return 0;
+    pthread_mutex_lock(&rings_lock);
+    r->next = rings;
+    r->thread = nrings++;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+    return r;
+}
+
+/*
+ * Record one event of the current thread.
+ */
+void mfm_trace_event(int type, int track, int arg1, int arg2)
+{
+    mfm_event_t *e;
+
+    if (! ring) {
+        ring = new_ring();
+        if (! ring)
+            return;
+    }
+    e = &ring->event[ring->count++ & (RING_EVENTS - 1)];
+    e->time = mfm_trace_clock();
+    e->type = type;
+    e->thread = ring->thread;
+    e->track = track;
+    e->arg1 = arg1;
+    e->arg2 = arg2;
+}
+
+static void write_all(int fd, const void *buf, size_t nbytes)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (nbytes > 0) {
+        n = write(fd, p, nbytes);
+        if (n <= 0)
+            return;
+        p += n;
+        nbytes -= n;
+    }
+}
+
+/*
+ * Write all rings to the trace file, oldest events first.
+ * Uses only write(), so it is safe in a signal handler.
+ */
+static void trace_write()
+{
+    uint32_t header [2] = { 1, sizeof(mfm_event_t) };
+    unsigned first;
+    ring_t *r;
+    int fd;
+
+    if (written)
+        return;
+    written = 1;
+    fd = open(trace_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return;
+    write_all(fd, MFM_TRACE_MAGIC, 8);
+    write_all(fd, header, sizeof(header));
+    for (r=rings; r; r=r->next) {
+        if (r->count <= RING_EVENTS) {
+            write_all(fd, r->event, r->count * sizeof(mfm_event_t));
+            continue;
+        }
+        first = r->count & (RING_EVENTS - 1);
+        write_all(fd, &r->event[first], (RING_EVENTS - first) * sizeof(mfm_event_t));
+        write_all(fd, r->event, first * sizeof(mfm_event_t));
+    }
+    close(fd);
+}
+
+static void trace_signal(int sig)
+{
+    trace_write();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*
+ * Start tracing; the events are written to the file
+ * when the program exits or is killed by a signal.
+ */
+void mfm_trace_start(const char *filename)
+{
+    unsigned i;
+
+    if (mfm_tracing)
+        return;
+    trace_filename = strdup(filename);
+    start_time = now();
+    ring = new_ring();
+    atexit(trace_write);
+    for (i=0; i<sizeof(fatal_signals)/sizeof(fatal_signals[0]); ++i)
+        signal(fatal_signals[i], trace_signal);
+    mfm_tracing = 1;
+}
@@ -0,0 +1,458 @@
+/*
+ * Processing of MFM image tracks, serially or by a pool of threads.
+ *
+ * Copyright (C) 2026 Serge Vakulenko
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "config.h"
+#include "mfm.h"
+
+int mfm_jobs;                   /* -j: number of threads */
+
+/*
+ * Tracks are independent, so they can be decoded by several threads.
+ * Each track writes its diagnostics into a private memory stream;
+ * the calling thread prints them strictly in track order, so the
+ * output is the same as for the serial loop.
+ */
+typedef struct {
+    char *text;                 /* diagnostics of the track */
+    size_t len;
+    int status;                 /* value returned by func */
+    int ready;                  /* track is done */
+} result_t;
+
+typedef struct {
+    mfm_image_t *img;
+    mfm_track_func_t *func;
+    void *arg;
+    int first;                  /* first track of the range */
+    const int *list;            /* or the list of tracks */
+    int next;                   /* next track to take, as an index */
+    int stop;                   /* tracks from this one are not needed */
+    result_t *result;           /* indexed like tracks */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} pool_t;
+
+static void *worker(void *arg)
+{
+    pool_t *pool = arg;
+    mfm_reader_t reader;
+    result_t *r;
+    FILE *out;
+    int i, t, status, more;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next;
+        more = (i < pool->stop);
+        if (more)
+            pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (! more)
+            break;
+
+        t = pool->list ? pool->list[i] : pool->first + i;
+        r = &pool->result[i];
+        out = open_memstream(&r->text, &r->len);
+        if (! out) {
+            perror("open_memstream");
+            exit(-1);
+        }
+        mfm_err = out;
+        MFM_TRACE(MFM_EV_TRACK_BEGIN, t, 0, 0);
+        mfm_read_seek(&reader, pool->img, t);
+        status = pool->func(&reader, pool->arg);
+        MFM_TRACE(MFM_EV_TRACK_END, t, status, 0);
+        fclose(out);
+
+        pthread_mutex_lock(&pool->lock);
+        r->status = status;
+        r->ready = 1;
+        if (status && pool->stop > i + 1)
+            pool->stop = i + 1;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return 0;
+}
+
+/*
+ * Number of threads to use: 0 means all online processors.
+ */
+int mfm_jobs_online()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (n > 0) ? n : 1;
+}
+
+/*
+ * Call func for ntracks tracks: from first on, or those
+ * in the list when it is given.
+ */
+static int run_tracks(mfm_image_t *img, int first, const int *list,
+    int ntracks, mfm_track_func_t *func, void *arg)
+{
+    FILE *out = mfm_err;
+    mfm_reader_t reader;
+    pthread_t *threads;
+    pool_t pool;
+    result_t *r;
+    int nthreads, t, status, i, k;
+
+    nthreads = mfm_jobs;
+    if (nthreads > ntracks)
+        nthreads = ntracks;
+    if (nthreads <= 1 || ! img->map) {
+        /* Serial loop. */
+        for (k=0; k<ntracks; ++k) {
+            t = list ? list[k] : first + k;
+            MFM_TRACE(MFM_EV_TRACK_BEGIN, t, 0, 0);
+            mfm_read_seek(&reader, img, t);
+            status = func(&reader, arg);
+            MFM_TRACE(MFM_EV_TRACK_END, t, status, 0);
+            if (status)
+                return status;
+        }
+        return 0;
+    }
+
+    /* Select the decoding kernels before starting threads. */
+    mfm_decode_kernel();
+    mfm_crc_kernel();
+
+    pool.img = img;
+    pool.func = func;
+    pool.arg = arg;
+    pool.first = first;
+    pool.list = list;
+    pool.next = 0;
+    pool.stop = ntracks;
+    pool.result = calloc(ntracks, sizeof(result_t));
+    threads = calloc(nthreads, sizeof(pthread_t));
+    if (! pool.result || ! threads) {
+        fprintf(stderr, "Out of memory, aborted.\n");
+        exit(-1);
+    }
+    pthread_mutex_init(&pool.lock, 0);
+    pthread_cond_init(&pool.done, 0);
+    for (i=0; i<nthreads; ++i) {
+        if (pthread_create(&threads[i], 0, worker, &pool) != 0) {
+            if (i == 0) {
+                perror("pthread_create");
+                exit(-1);
+            }
+            nthreads = i;
+            break;
+        }
+    }
+
+    /* Print diagnostics in track order. */
+    status = 0;
+    for (k=0; k<ntracks; ++k) {
+        r = &pool.result[k];
+        pthread_mutex_lock(&pool.lock);
+        while (! r->ready)
+            pthread_cond_wait(&pool.done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        fwrite(r->text, 1, r->len, out);
+        status = r->status;
+        if (status)
+            break;
+    }
+
+    for (i=0; i<nthreads; ++i)
+        pthread_join(threads[i], 0);
+    for (k=0; k<ntracks; ++k)
+        free(pool.result[k].text);
+    pthread_cond_destroy(&pool.done);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.result);
+    free(threads);
+    return status;
+}
+
+/*
+ * Call func for every track from first to last-1.
+ * When func returns nonzero, the remaining tracks are skipped
+ * and this value is returned.  With mfm_jobs above 1 and a mapped
+ * image the tracks are processed in parallel.
+ */
+int mfm_for_each_track(mfm_image_t *img, int first, int last,
+    mfm_track_func_t *func, void *arg)
+{
+    return run_tracks(img, first, 0, last - first, func, arg);
+}
+
+/*
+ * The same for ntracks tracks from the list, in increasing order,
+ * so that a pipe is read only once.  Only the listed tracks are read.
+ */
+int mfm_for_track_list(mfm_image_t *img, const int *tracks, int ntracks,
+    mfm_track_func_t *func, void *arg)
+{
+    return run_tracks(img, 0, tracks, ntracks, func, arg);
+}
+
+/*
+ * Encoding is parallel as well.  Every track is assembled in its own
+ * buffer and copied to its place in an aligned image buffer, which
+ * is written out with one call when all tracks are done.
+ */
+typedef struct {
+    mfm_encode_func_t *func;
+    void *arg;
+    int ntracks;
+    int next;                   /* next track to take */
+    unsigned char *data;        /* the whole image */
+    pthread_mutex_t lock;
+} encode_pool_t;
+
+static void *encode_worker(void *arg)
+{
+    encode_pool_t *pool = arg;
+    mfm_writer_t writer;
+    int t;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        t = pool->next;
+        if (t < pool->ntracks)
+            pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (t >= pool->ntracks)
+            break;
+
+        MFM_TRACE(MFM_EV_TRACK_BEGIN, t, 0, 0);
+        mfm_write_reset(&writer, 0);
+        pool->func(&writer, t, pool->arg);
+        MFM_TRACE(MFM_EV_TRACK_END, t, 0, 0);
+        memcpy(pool->data + (size_t) t * TRACKSZ, writer.buf, TRACKSZ);
+    }
+    return 0;
+}
+
+/*
+ * Encode ntracks tracks by calling func for each of them,
+ * and write the result to fout.  With mfm_jobs above 1
+ * the tracks are encoded in parallel.
+ */
+void mfm_write_tracks(FILE *fout, int ntracks, mfm_encode_func_t *func, void *arg)
+{
+    mfm_writer_t writer;
+    pthread_t *threads;
+    encode_pool_t pool;
+    int nthreads, t, i;
+
+    pool.func = func;
+    pool.arg = arg;
+    pool.ntracks = ntracks;
+    pool.next = 0;
+    pool.data = mfm_output_alloc((size_t) ntracks * TRACKSZ);
+
+    nthreads = mfm_jobs;
+    if (nthreads > ntracks)
+        nthreads = ntracks;
+    if (nthreads <= 1) {
+        /* Serial loop. */
+        for (t=0; t<ntracks; ++t) {
+            MFM_TRACE(MFM_EV_TRACK_BEGIN, t, 0, 0);
+            mfm_write_reset(&writer, 0);
+            func(&writer, t, arg);
+            MFM_TRACE(MFM_EV_TRACK_END, t, 0, 0);
+            memcpy(pool.data + (size_t) t * TRACKSZ, writer.buf, TRACKSZ);
+        }
+    } else {
+        /* Select the checksum kernel before starting threads. */
+        mfm_crc_kernel();
+
+        threads = calloc(nthreads, sizeof(pthread_t));
+        if (! threads) {
+            fprintf(stderr, "Out of memory, aborted.\n");
+            exit(-1);
+        }
+        pthread_mutex_init(&pool.lock, 0);
+        for (i=0; i<nthreads; ++i) {
+            if (pthread_create(&threads[i], 0, encode_worker, &pool) != 0) {
+                if (i == 0) {
+                    perror("pthread_create");
+                    exit(-1);
+                }
+                nthreads = i;
+                break;
+            }
+        }
+        for (i=0; i<nthreads; ++i)
+            pthread_join(threads[i], 0);
+        pthread_mutex_destroy(&pool.lock);
+        free(threads);
+    }
+    mfm_output_write(fout, pool.data, (size_t) ntracks * TRACKSZ);
+    free(pool.data);
+}
+
+/*
+ * When the sectors still come from a pipe, the disk is converted
+ * by a pipeline: one thread reads the sectors of the next tracks,
+ * the calling thread encodes, and another one writes the encoded
+ * tracks out.  A disk already in memory goes to the parallel
+ * encoder and is written with one call.
+ */
+typedef struct {
+    mfm_disk_t *disk;
+    FILE *fout;
+    mfm_encode_func_t *func;
+    void *arg;
+} write_pipe_t;
+
+static int load_stage(void *slot, int t, void *arg)
+{
+    write_pipe_t *wp = arg;
+
+    return mfm_read_raw_track(wp->disk, t) < 0;
+}
+
+static int encode_stage(void *slot, int t, void *arg)
+{
+    write_pipe_t *wp = arg;
+    mfm_writer_t *writer = slot;
+
+    MFM_TRACE(MFM_EV_TRACK_BEGIN, t, 0, 0);
+    mfm_write_reset(writer, 0);
+    wp->func(writer, t, wp->arg);
+    MFM_TRACE(MFM_EV_TRACK_END, t, 0, 0);
+    return 0;
+}
+
+static int output_stage(void *slot, int t, void *arg)
+{
+    write_pipe_t *wp = arg;
+    mfm_writer_t *writer = slot;
+
+    mfm_output_write(wp->fout, writer->buf, TRACKSZ);
+    return 0;
+}
+
+/*
+ * Encode all tracks of the disk by calling func for each of them,
+ * and write the result to fout.
+ */
+void mfm_write_disk(FILE *fout, mfm_disk_t *d, mfm_encode_func_t *func, void *arg)
+{
+    mfm_writer_t *slots;
+    write_pipe_t wp;
+
+    if (! d->fin) {
+        mfm_write_tracks(fout, d->ntracks, func, arg);
+        return;
+    }
+    slots = mfm_output_alloc(MFM_PIPELINE_DEPTH * sizeof(mfm_writer_t));
+    wp.disk = d;
+    wp.fout = fout;
+    wp.func = func;
+    wp.arg = arg;
+    mfm_pipeline(slots, sizeof(mfm_writer_t), d->ntracks,
+        load_stage, encode_stage, output_stage, &wp);
+    free(slots);
+    d->fin = 0;
+}
+
+/*
+ * Streaming extraction is a pipeline as well: the next tracks
+ * are read from the image while the current one is decoded,
+ * and the sectors of the previous ones are written out.
+ */
+typedef struct {
+    mfm_image_t *img;
+    FILE *fout;
+    mfm_stream_func_t *func;
+    void *arg;
+} stream_pipe_t;
+
+static int read_stage(void *slot, int t, void *arg)
+{
+    stream_pipe_t *sp = arg;
+    mfm_reader_t *reader = &((mfm_stream_slot_t*) slot)->reader;
+
+    /* The track must not stay in the buffer of the image,
+     * which is reused for the next one. */
+    mfm_read_seek(reader, sp->img, t);
+    if (reader->nbytes > 0 && reader->data == sp->img->track) {
+        memcpy(reader->buf, reader->data, reader->nbytes);
+        reader->data = reader->buf;
+    }
+    return 0;
+}
+
+static int decode_stage(void *slot, int t, void *arg)
+{
+    stream_pipe_t *sp = arg;
+
+    MFM_TRACE(MFM_EV_TRACK_BEGIN, t, 0, 0);
+    sp->func(slot, sp->arg);
+    MFM_TRACE(MFM_EV_TRACK_END, t, 0, 0);
+    return 0;
+}
+
+static int write_stage(void *slot, int t, void *arg)
+{
+    stream_pipe_t *sp = arg;
+    mfm_stream_slot_t *ss = slot;
+
+    mfm_write_raw_track(&ss->td, ss->nsectors_per_track, ss->size, sp->fout);
+    fflush(sp->fout);
+    return 0;
+}
+
+/*
+ * Extract ntracks tracks of the image to fout, calling func
+ * to decode each of them, in track order.
+ */
+void mfm_stream_tracks(mfm_image_t *img, int ntracks, FILE *fout,
+    mfm_stream_func_t *func, void *arg)
+{
+    mfm_stream_slot_t *slots;
+    stream_pipe_t sp;
+
+    slots = calloc(MFM_PIPELINE_DEPTH, sizeof(mfm_stream_slot_t));
+    if (! slots) {
+        fprintf(stderr, "Out of memory, aborted.\n");
+        exit(-1);
+    }
+    sp.img = img;
+    sp.fout = fout;
+    sp.func = func;
+    sp.arg = arg;
+    mfm_pipeline(slots, sizeof(mfm_stream_slot_t), ntracks,
+        read_stage, decode_stage, write_stage, &sp);
+    free(slots);
+}